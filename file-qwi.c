@@ -37,6 +37,7 @@
 
 #include "math.h"
 #include "file-qwi.h"
+#include "qwi-thumbcache.h"
 
 //#include "libgimp/stdplugins-intl.h"
 
@@ -44,6 +45,8 @@
 const gchar *filename    = NULL;
 gboolean     qwi_interactive = FALSE;
 gboolean     qwi_lastvals = FALSE;
+gint         qwi_threads = 1;
+gint         qwi_target_size = -1;
 
 
 /* Declare some local functions.
@@ -54,6 +57,12 @@ static void   run   (const gchar      *name,
                      const GimpParam  *param,
                      gint             *nreturn_vals,
                      GimpParam       **return_vals);
+static gint   get_threads (void);
+static gint32 thumbnail_to_image (const QWIThumbnail *thumb);
+static gboolean image_to_thumbnail (gint32         image_ID,
+                                    guint16        image_width,
+                                    guint16        image_height,
+                                    QWIThumbnail  *thumb);
 
 const GimpPlugInInfo PLUG_IN_INFO =
 {
@@ -93,6 +102,29 @@ query (void)
     { GIMP_PDB_INT32,  "image-height", "Height of full-sized image"    }
   };
 
+  /* Scaled load */
+  static const GimpParamDef scaled_args[] =
+  {
+    { GIMP_PDB_INT32,    "run-mode",     "The run mode { RUN-INTERACTIVE (0), RUN-NONINTERACTIVE (1) }" },
+    { GIMP_PDB_STRING,   "filename",     "The name of the file to load" },
+    { GIMP_PDB_STRING,   "raw-filename", "The name entered" },
+    { GIMP_PDB_INT32,    "max-size",     "Maximum width and height of the loaded image (0 = full size)" },
+    { GIMP_PDB_INT32,    "level",        "Number of resolution levels to drop, each halving the size (-1 = from max-size)" },
+  };
+
+  /* Region load */
+  static const GimpParamDef region_args[] =
+  {
+    { GIMP_PDB_INT32,    "run-mode",     "The run mode { RUN-INTERACTIVE (0), RUN-NONINTERACTIVE (1) }" },
+    { GIMP_PDB_STRING,   "filename",     "The name of the file to load" },
+    { GIMP_PDB_STRING,   "raw-filename", "The name entered" },
+    { GIMP_PDB_INT32,    "x",            "Left edge of the region, in full size pixels" },
+    { GIMP_PDB_INT32,    "y",            "Top edge of the region, in full size pixels" },
+    { GIMP_PDB_INT32,    "width",        "Width of the region, in full size pixels" },
+    { GIMP_PDB_INT32,    "height",       "Height of the region, in full size pixels" },
+    { GIMP_PDB_INT32,    "level",        "Number of resolution levels to drop, each halving the size (0 = full size)" },
+  };
+
   static const GimpParamDef save_args[] =
   {
     { GIMP_PDB_INT32,    "run-mode",     "The run mode { RUN-INTERACTIVE (0), RUN-NONINTERACTIVE (1) }" },
@@ -102,6 +134,16 @@ query (void)
     { GIMP_PDB_STRING,   "raw-filename", "The name entered" },
   };
 
+  static const GimpParamDef save_to_size_args[] =
+  {
+    { GIMP_PDB_INT32,    "run-mode",     "The run mode { RUN-INTERACTIVE (0), RUN-NONINTERACTIVE (1) }" },
+    { GIMP_PDB_IMAGE,    "image",        "Input image" },
+    { GIMP_PDB_DRAWABLE, "drawable",     "Drawable to save" },
+    { GIMP_PDB_STRING,   "filename",     "The name of the file to save the image in" },
+    { GIMP_PDB_STRING,   "raw-filename", "The name entered" },
+    { GIMP_PDB_INT32,    "target-size",  "Highest size of each layer in bytes, reached by lowering the quality (0 = off)" },
+  };
+
   gimp_install_procedure (LOAD_PROC,
                           "Loads files of QWI file format",
                           "Loads files of QWI file format",
@@ -137,6 +179,40 @@ query (void)
 
   gimp_register_thumbnail_loader (LOAD_PROC, LOAD_THUMB_PROC);
 
+  /* Scaled load */
+  gimp_install_procedure (LOAD_SCALED_PROC,
+                          "Loads QWI files at a reduced size",
+                          "Loads every element of a QWI file from its lower "
+                          "resolution levels only, either until the image fits "
+                          "in max-size or by dropping an explicit number of "
+                          "levels. This is much cheaper than a full decode "
+                          "followed by a scale.",
+                          "Stéphane Bacri",
+                          "Stéphane Bacri",
+                          "2015",
+                          NULL,
+                          NULL,
+                          GIMP_PLUGIN,
+                          G_N_ELEMENTS (scaled_args),
+                          G_N_ELEMENTS (load_return_vals),
+                          scaled_args, load_return_vals);
+
+  /* Region load */
+  gimp_install_procedure (LOAD_REGION_PROC,
+                          "Loads a region of a QWI file",
+                          "Loads the x/y/width/height rectangle of a QWI file, "
+                          "optionally at a reduced resolution. Elements outside "
+                          "of the rectangle are neither read nor decoded.",
+                          "Stéphane Bacri",
+                          "Stéphane Bacri",
+                          "2015",
+                          NULL,
+                          NULL,
+                          GIMP_PLUGIN,
+                          G_N_ELEMENTS (region_args),
+                          G_N_ELEMENTS (load_return_vals),
+                          region_args, load_return_vals);
+
   gimp_install_procedure (SAVE_PROC,
                           "Saves files in QWI file format",
                           "Saves files in QWI file format",
@@ -151,6 +227,21 @@ query (void)
 
   gimp_register_file_handler_mime (SAVE_PROC, "image/x-qwi");
   gimp_register_save_handler (SAVE_PROC, "qwi", "");
+
+  /* Save with a size cap */
+  gimp_install_procedure (SAVE_TO_SIZE_PROC,
+                          "Saves files in QWI file format, under a size",
+                          "Saves like file-qwi-save, lowering the quality of "
+                          "each layer until it fits in target-size bytes. The "
+                          "other settings are the last ones used.",
+                          "Stéphane Bacri",
+                          "Stéphane Bacri",
+                          "2015",
+                          NULL,
+                          "GRAY, RGB*",// INDEXED*",
+                          GIMP_PLUGIN,
+                          G_N_ELEMENTS (save_to_size_args), 0,
+                          save_to_size_args, NULL);
 }
 
 static void
@@ -195,9 +286,14 @@ run (const gchar      *name,
           break;
         }
 
+       qwi_threads = get_threads ();
+
        if (status == GIMP_PDB_SUCCESS)
          {
-           image_ID = ReadQWI (param[1].data.d_string, 0, NULL, NULL, &error);
+           QWILoadVals vals = { 0, -1, FALSE };
+
+           vals.progressive = qwi_interactive && !g_getenv ("QWI_NO_PROGRESSIVE");
+           image_ID = ReadQWI (param[1].data.d_string, &vals, NULL, NULL, &error);
 
            if (image_ID != -1)
              {
@@ -221,11 +317,32 @@ run (const gchar      *name,
       else
         {
           const gchar *filename = param[0].data.d_string;
-          guint32      lowres = param[1].data.d_int32;
+          QWILoadVals  vals     = { param[1].data.d_int32, -1, TRUE };
           guint16      width    = 0;
           guint16      height   = 0;
+          QWIThumbnail thumb;
 
-          image_ID = ReadQWI (filename, lowres, &width, &height, &error);
+          // file managers ask for the same thumbnails over and over: keep them on disk
+          image_ID = -1;
+          if (qwi_thumbcache_lookup (filename, vals.max_size, &thumb))
+            {
+              image_ID = thumbnail_to_image (&thumb);
+              width = thumb.image_width;
+              height = thumb.image_height;
+              qwi_thumbnail_clear (&thumb);
+            }
+
+          if (image_ID == -1)
+            {
+              qwi_threads = get_threads ();
+              image_ID = ReadQWI (filename, &vals, &width, &height, &error);
+
+              if (image_ID != -1 && image_to_thumbnail (image_ID, width, height, &thumb))
+                {
+                  qwi_thumbcache_store (filename, vals.max_size, &thumb);
+                  qwi_thumbnail_clear (&thumb);
+                }
+            }
 
           if (image_ID != -1)
             {
@@ -243,8 +360,55 @@ run (const gchar      *name,
             }
         }
     }
-  else if (strcmp (name, SAVE_PROC) == 0)
+  /* Scaled and region loads */
+  else if (strcmp (name, LOAD_SCALED_PROC) == 0 || strcmp (name, LOAD_REGION_PROC) == 0)
+    {
+      gboolean region = strcmp (name, LOAD_REGION_PROC) == 0;
+
+      if (nparams < (region ? 8 : 5))
+        {
+          status = GIMP_PDB_CALLING_ERROR;
+        }
+      else
+        {
+          QWILoadVals vals = { 0, -1, FALSE };
+
+          if (region)
+            {
+              vals.region_x      = param[3].data.d_int32;
+              vals.region_y      = param[4].data.d_int32;
+              vals.region_width  = MAX (param[5].data.d_int32, 1);
+              vals.region_height = MAX (param[6].data.d_int32, 1);
+              vals.level         = MAX (param[7].data.d_int32, 0);
+            }
+          else
+            {
+              vals.max_size = MAX (param[3].data.d_int32, 0);
+              vals.level    = param[4].data.d_int32;
+            }
+
+          if (run_mode == GIMP_RUN_INTERACTIVE)
+            qwi_interactive = TRUE;
+
+          qwi_threads = get_threads ();
+          image_ID = ReadQWI (param[1].data.d_string, &vals, NULL, NULL, &error);
+
+          if (image_ID != -1)
+            {
+              *nreturn_vals = 2;
+              values[1].type         = GIMP_PDB_IMAGE;
+              values[1].data.d_image = image_ID;
+            }
+          else
+            {
+              status = GIMP_PDB_EXECUTION_ERROR;
+            }
+        }
+    }
+  else if (strcmp (name, SAVE_PROC) == 0 || strcmp (name, SAVE_TO_SIZE_PROC) == 0)
     {
+      gboolean to_size = strcmp (name, SAVE_TO_SIZE_PROC) == 0;
+
       image_ID    = param[1].data.d_int32;
       drawable_ID = param[2].data.d_int32;
 
@@ -277,7 +441,7 @@ run (const gchar      *name,
 
         case GIMP_RUN_NONINTERACTIVE:
           /*  Make sure all the arguments are there!  */
-          if (nparams != 5)
+          if (nparams != (to_size ? 6 : 5))
             status = GIMP_PDB_CALLING_ERROR;
           break;
 
@@ -285,6 +449,14 @@ run (const gchar      *name,
           break;
         }
 
+      if (to_size && status == GIMP_PDB_SUCCESS)
+        {
+          qwi_target_size = MAX (param[5].data.d_int32, 0);
+          qwi_lastvals = TRUE;
+        }
+
+      qwi_threads = get_threads ();
+
       if (status == GIMP_PDB_SUCCESS)
         status = WriteQWI (param[3].data.d_string, image_ID, drawable_ID,
                            &error);
@@ -306,3 +478,104 @@ run (const gchar      *name,
 
   values[0].data.d_status = status;
 }
+
+/* Number of threads handed to the codec: the QWI_THREADS environment
+ * variable (so a batch host can pin it), then GIMP's own "num-processors"
+ * preference, then the number of CPUs. It is not a PDB argument, so the
+ * load procedure keeps its standard signature.
+ */
+static gint
+get_threads (void)
+{
+  const gchar *env;
+  gchar       *rc;
+  gint         threads = 0;
+
+  if ((env = g_getenv ("QWI_THREADS")) != NULL)
+    threads = atoi (env);
+
+  if (threads <= 0 && (rc = gimp_gimprc_query ("num-processors")) != NULL)
+    {
+      threads = atoi (rc);
+      g_free (rc);
+    }
+
+  if (threads <= 0)
+    threads = g_get_num_processors ();
+
+  return CLAMP (threads, 1, QWI_MAX_THREADS);
+}
+
+/* Rebuilds the image ReadQWI made for a thumbnail from its cached pixels */
+static gint32
+thumbnail_to_image (const QWIThumbnail *thumb)
+{
+  static const GimpImageType types[] = { GIMP_GRAY_IMAGE, GIMP_GRAYA_IMAGE,
+                                         GIMP_RGB_IMAGE, GIMP_RGBA_IMAGE };
+  GimpDrawable *drawable;
+  GimpPixelRgn  pixel_rgn;
+  gint32        image_ID;
+  gint32        layer;
+
+  image_ID = gimp_image_new (thumb->width, thumb->height,
+                             thumb->planes < 3 ? GIMP_GRAY : GIMP_RGB);
+  layer = gimp_layer_new (image_ID, "Thumbnail",
+                          thumb->layer_width, thumb->layer_height,
+                          types[thumb->planes - 1], 100, GIMP_NORMAL_MODE);
+  gimp_image_insert_layer (image_ID, layer, -1, 0);
+  gimp_layer_set_offsets (layer, thumb->layer_x, thumb->layer_y);
+
+  drawable = gimp_drawable_get (layer);
+  gimp_pixel_rgn_init (&pixel_rgn, drawable, 0, 0,
+                       thumb->layer_width, thumb->layer_height, TRUE, FALSE);
+  gimp_pixel_rgn_set_rect (&pixel_rgn, thumb->pixels, 0, 0,
+                           thumb->layer_width, thumb->layer_height);
+  gimp_drawable_flush (drawable);
+  gimp_drawable_detach (drawable);
+
+  return image_ID;
+}
+
+/* Grabs the single layer of a freshly loaded thumbnail for the cache */
+static gboolean
+image_to_thumbnail (gint32        image_ID,
+                    guint16       image_width,
+                    guint16       image_height,
+                    QWIThumbnail *thumb)
+{
+  GimpDrawable *drawable;
+  GimpPixelRgn  pixel_rgn;
+  gint32       *layers;
+  gint          nlayers;
+  gint          x, y;
+
+  layers = gimp_image_get_layers (image_ID, &nlayers);
+  if (nlayers != 1)
+    {
+      g_free (layers);
+      return FALSE;
+    }
+
+  drawable = gimp_drawable_get (layers[0]);
+  gimp_drawable_offsets (layers[0], &x, &y);
+  g_free (layers);
+
+  thumb->image_width  = image_width;
+  thumb->image_height = image_height;
+  thumb->width        = gimp_image_width (image_ID);
+  thumb->height       = gimp_image_height (image_ID);
+  thumb->layer_width  = drawable->width;
+  thumb->layer_height = drawable->height;
+  thumb->layer_x      = x;
+  thumb->layer_y      = y;
+  thumb->planes       = drawable->bpp;
+  thumb->pixels       = g_malloc ((gsize) drawable->width * drawable->height * drawable->bpp);
+
+  gimp_pixel_rgn_init (&pixel_rgn, drawable, 0, 0,
+                       drawable->width, drawable->height, FALSE, FALSE);
+  gimp_pixel_rgn_get_rect (&pixel_rgn, thumb->pixels, 0, 0,
+                           drawable->width, drawable->height);
+  gimp_drawable_detach (drawable);
+
+  return TRUE;
+}
@@ -21,7 +21,10 @@
 
 #define LOAD_PROC       "file-qwi-load"
 #define LOAD_THUMB_PROC "file-qwi-load-thumb"
+#define LOAD_SCALED_PROC "file-qwi-load-scaled"
+#define LOAD_REGION_PROC "file-qwi-load-region"
 #define SAVE_PROC       "file-qwi-save"
+#define SAVE_TO_SIZE_PROC "file-qwi-save-to-size"
 #define PLUG_IN_BINARY  "file-qwi"
 #define PLUG_IN_ROLE    "gimp-file-qwi"
 
@@ -33,8 +36,23 @@
 
 #define CEIL_RSHIFT(a,b) (((a) + (1<<b)-1) >> b)
 
+#define QWI_MAX_THREADS  64
+
+/* How ReadQWI decodes a file */
+typedef struct
+{
+  guint32   max_size;   /* drop resolution levels until both sides fit, 0 = full size */
+  gint      level;      /* number of resolution levels to drop, -1 = from max_size */
+  gboolean  thumbnail;  /* only decode the first element */
+  gint      region_x;   /* region of interest, in full size pixels */
+  gint      region_y;
+  gint      region_width;   /* 0 = whole image */
+  gint      region_height;
+  gboolean  progressive;  /* show the lower resolution levels first */
+} QWILoadVals;
+
 gint32             ReadQWI   (const gchar  *filename,
-		  	  	  	  	  	  guint32       thumb,
+                              const QWILoadVals *vals,
 		  	  	  	  	  	  guint16       *image_width,
 		  	  	  	  	  	  guint16       *image_height,
                               GError      **error);
@@ -46,6 +64,8 @@ GimpPDBStatusType  WriteQWI  (const gchar  *filename,
 
 extern       gboolean  qwi_interactive;
 extern       gboolean  qwi_lastvals;
+extern       gint      qwi_threads;
+extern       gint      qwi_target_size;   /* from file-qwi-save-to-size, -1 = saved values */
 extern const gchar    *filename;
 extern 		 gchar    *javascript_code;
 
@@ -0,0 +1,457 @@
+/* qwi-bench.c  Encode and decode benchmark on a synthetic corpus.   */
+
+/*
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if !defined(WIN32) && !defined(__MINGW32__)
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "qwi.h"
+#include "qwi-input.h"
+#include "qwi-simd.h"
+#include "qwi-core.h"
+
+/* qwi-bench [options]
+ *
+ * Builds each corpus image in memory (always the same pixels for the same
+ * seed), then for every preset encodes it to a file and decodes it back,
+ * keeping the best of --repeat runs. Results go to stdout as JSON.
+ */
+
+typedef enum
+{
+	CORPUS_GRADIENT,
+	CORPUS_NOISE,
+	CORPUS_LINEART,
+	CORPUS_ALPHA,
+	CORPUS_MULTILAYER,
+	CORPUS_ANIMATED,
+	N_CORPUS
+} Corpus;
+
+static const gchar *corpus_names[N_CORPUS] =
+{
+	"gradient", "noise", "lineart", "alpha", "multilayer", "animated"
+};
+
+static gchar     *sizes = NULL;
+static gchar     *corpora = NULL;
+static gchar     *presets = NULL;
+static gint       repeat = 3;
+static gint       threads = 1;
+static gint       seed = 1;
+static gchar     *work_dir = NULL;
+
+static GOptionEntry entries[] =
+{
+	{ "sizes", 'm', 0, G_OPTION_ARG_STRING, &sizes, "Image sizes in megapixels, 1-100 (default: 1,4,16)", "LIST" },
+	{ "corpus", 'c', 0, G_OPTION_ARG_STRING, &corpora, "gradient, noise, lineart, alpha, multilayer, animated (default: all)", "LIST" },
+	{ "presets", 'p', 0, G_OPTION_ARG_STRING, &presets, "Save dialog presets, 0-4 (default: all)", "LIST" },
+	{ "repeat", 'r', 0, G_OPTION_ARG_INT, &repeat, "Runs per measure, the best one is kept (default: 3)", "N" },
+	{ "threads", 't', 0, G_OPTION_ARG_INT, &threads, "Decoding threads (default: 1)", "N" },
+	{ "seed", 's', 0, G_OPTION_ARG_INT, &seed, "Corpus generator seed (default: 1)", "N" },
+	{ "dir", 'd', 0, G_OPTION_ARG_FILENAME, &work_dir, "Where the encoded files go (default: temporary directory)", "DIR" },
+	{ NULL }
+};
+
+// xorshift32: the corpus must not depend on the C library
+static guint32
+next_random (guint32 *state)
+{
+	guint32 x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+static void
+fill_layer (QWICoreLayer *layer,
+		Corpus        corpus,
+		guint32      *state,
+		guint         frame)
+{
+	guchar *p = layer->pixels;
+	guint   x, y;
+
+	for (y = 0; y < layer->height; y++)
+		for (x = 0; x < layer->width; x++) {
+			guint32 r = next_random (state);
+
+			switch (corpus) {
+			case CORPUS_GRADIENT:
+			case CORPUS_MULTILAYER:
+			case CORPUS_ANIMATED:
+				// smooth content, with a little sensor-like noise, moving with the frame number
+				p[0] = (x + frame * 8) * 255 / layer->width + (r & 3);
+				p[1] = y * 255 / layer->height + ((r >> 2) & 3);
+				p[2] = (x + y) * 127 / (layer->width + layer->height) + 64 + ((r >> 4) & 3);
+				if (layer->planes == 4)
+					p[3] = corpus == CORPUS_MULTILAYER && (x / 64 + y / 64) % 3 == 0 ? 0 : 255;
+				break;
+			case CORPUS_NOISE:
+				p[0] = r;
+				p[1] = r >> 8;
+				p[2] = r >> 16;
+				break;
+			case CORPUS_LINEART:
+				// dark strokes on white paper
+				p[0] = (x % 97 < 2 || y % 89 < 2 || (x + 2 * y) % 211 < 3) ? 16 + (r & 15) : 255;
+				break;
+			case CORPUS_ALPHA:
+				{
+					// soft edged disc on a gradient, fully transparent around it
+					gdouble dx = (gdouble) x / layer->width - 0.5;
+					gdouble dy = (gdouble) y / layer->height - 0.5;
+					gdouble d = sqrt (dx * dx + dy * dy);
+
+					p[0] = x * 255 / layer->width;
+					p[1] = 128;
+					p[2] = y * 255 / layer->height;
+					p[3] = d < 0.35 ? 255 : d < 0.4 ? (0.4 - d) * 255 / 0.05 : 0;
+				}
+				break;
+			default:
+				break;
+			}
+			p += layer->planes;
+		}
+}
+
+// builds the layers of a corpus image of about megapixels, in a 4:3 frame
+static QWICoreLayer *
+make_corpus (Corpus   corpus,
+		gdouble  megapixels,
+		guint    *n_layers,
+		guint32  *width,
+		guint32  *height,
+		guchar   *type)
+{
+	QWICoreLayer *layers;
+	guint32       state = seed ? seed : 1;
+	guint         i;
+
+	*width = MAX (32, (guint32) sqrt (megapixels * 1e6 * 4 / 3));
+	*height = MAX (32, (guint32) (megapixels * 1e6 / *width));
+	*n_layers = corpus == CORPUS_MULTILAYER ? 3 : corpus == CORPUS_ANIMATED ? 8 : 1;
+	*type = corpus == CORPUS_MULTILAYER ? QWI_TYPE_MULTILAYER : corpus == CORPUS_ANIMATED ? QWI_TYPE_ANIMATE : 0;
+
+	layers = g_new0 (QWICoreLayer, *n_layers);
+	for (i = 0; i < *n_layers; i++) {
+		QWICoreLayer *layer = &layers[i];
+
+		layer->width = *width;
+		layer->height = *height;
+		layer->planes = corpus == CORPUS_LINEART ? 1 : corpus == CORPUS_ALPHA || (corpus == CORPUS_MULTILAYER && i) ? 4 : 3;
+		if (corpus == CORPUS_MULTILAYER && i) {
+			// upper layers are smaller and offset, as in a real composition
+			layer->width = *width / 2;
+			layer->height = *height / 2;
+			layer->x = i * *width / 4;
+			layer->y = i * *height / 4;
+		}
+		if (corpus == CORPUS_ANIMATED)
+			layer->duration = qwi_core_set_duration (40);
+		layer->pixels = g_malloc ((gsize) layer->width * layer->height * layer->planes);
+		fill_layer (layer, corpus, &state, i);
+	}
+	return layers;
+}
+
+// parses "1,4,16" into values, keeping those in [min, max]
+static GArray *
+parse_list (const gchar *list,
+		const gchar *fallback,
+		gdouble      min,
+		gdouble      max)
+{
+	GArray  *values = g_array_new (FALSE, FALSE, sizeof (gdouble));
+	gchar  **items = g_strsplit (list ? list : fallback, ",", -1);
+	gint     i;
+
+	for (i = 0; items[i]; i++) {
+		gdouble value = g_ascii_strtod (items[i], NULL);
+		if (value >= min && value <= max)
+			g_array_append_val (values, value);
+	}
+	g_strfreev (items);
+	return values;
+}
+
+static gboolean
+run_case (const gchar        *path,
+		const QWICoreLayer *layers,
+		guint               n_layers,
+		guint32             width,
+		guint32             height,
+		guchar              type,
+		const QWIPreset    *preset,
+		gdouble            *encode_time,
+		gdouble            *decode_time,
+		goffset            *size,
+		GError            **error)
+{
+	QWIEncodeParams params;
+	struct stat     st;
+	gint            run;
+
+	qwi_core_preset_params (preset, width, height, layers[0].planes, &params);
+	params.duration = layers[0].duration;
+	*encode_time = *decode_time = G_MAXDOUBLE;
+
+	for (run = 0; run < repeat; run++) {
+		QWICoreLayer *decoded;
+		QWI_ELEMENT   element;
+		guint         n_decoded;
+		gint64        start;
+
+		start = g_get_monotonic_time ();
+		if (!qwi_core_save (path, layers, n_layers, width, height, type, &params, NULL, error))
+			return FALSE;
+		*encode_time = MIN (*encode_time, (g_get_monotonic_time () - start) / 1e6);
+
+		start = g_get_monotonic_time ();
+		decoded = qwi_core_load (path, threads, &n_decoded, &element, error);
+		if (!decoded)
+			return FALSE;
+		*decode_time = MIN (*decode_time, (g_get_monotonic_time () - start) / 1e6);
+		qwi_core_layers_free (decoded, n_decoded);
+	}
+
+	*size = g_stat (path, &st) == 0 ? st.st_size : 0;
+	return TRUE;
+}
+
+/* What a case measured, passed back from the child that ran it */
+typedef struct
+{
+	gdouble  encode_time;
+	gdouble  decode_time;
+	goffset  size;
+	glong    peak_rss;    /* KiB, of the case alone */
+} CaseResult;
+
+#if !defined(WIN32) && !defined(__MINGW32__)
+static gboolean
+read_full (int      fd,
+		gpointer buffer,
+		gsize    length)
+{
+	while (length) {
+		gssize n = read (fd, buffer, length);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return FALSE;
+		buffer = (guchar *) buffer + n;
+		length -= n;
+	}
+	return TRUE;
+}
+#endif
+
+/* Runs a case in a child process of its own: ru_maxrss only ever grows, so
+ * the peak of a case measured in this process would be the largest of the
+ * cases so far. Without fork, the cases run here and the peak is left at 0. */
+static gboolean
+run_case_isolated (const gchar        *path,
+		const QWICoreLayer *layers,
+		guint               n_layers,
+		guint32             width,
+		guint32             height,
+		guchar              type,
+		const QWIPreset    *preset,
+		CaseResult         *result,
+		GError            **error)
+{
+#if !defined(WIN32) && !defined(__MINGW32__)
+	struct rusage usage;
+	gboolean      ok = FALSE;
+	GString      *message;
+	gchar         c;
+	int           fds[2];
+	int           wstatus;
+	pid_t         pid;
+
+	memset (result, 0, sizeof (CaseResult));
+	fflush (stdout);
+	if (pipe (fds) != 0 || (pid = fork ()) < 0) {
+		g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+				"Could not start the case: %s", g_strerror (errno));
+		return FALSE;
+	}
+
+	if (!pid) {
+		// the child: the result, or the error message, goes through the pipe
+		GError *child_error = NULL;
+
+		close (fds[0]);
+		ok = run_case (path, layers, n_layers, width, height, type, preset,
+				&result->encode_time, &result->decode_time, &result->size, &child_error);
+		if (write (fds[1], &ok, sizeof (ok)) == sizeof (ok)) {
+			if (ok && write (fds[1], result, sizeof (CaseResult)) != sizeof (CaseResult))
+				ok = FALSE;
+			else if (!ok && write (fds[1], child_error->message, strlen (child_error->message)) < 0)
+				ok = FALSE;
+		}
+		_exit (ok ? 0 : 1);
+	}
+
+	close (fds[1]);
+	message = g_string_new (NULL);
+	if (read_full (fds[0], &ok, sizeof (ok))) {
+		if (ok)
+			ok = read_full (fds[0], result, sizeof (CaseResult));
+		else
+			while (read_full (fds[0], &c, 1))
+				g_string_append_c (message, c);
+	}
+	close (fds[0]);
+	// the usage of this child alone: RUSAGE_CHILDREN keeps the largest peak of them all
+	memset (&usage, 0, sizeof (usage));
+	while (wait4 (pid, &wstatus, 0, &usage) < 0 && errno == EINTR)
+		;
+
+	if (!ok)
+		g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "%s",
+				message->len ? message->str : "the case did not complete");
+	g_string_free (message, TRUE);
+	result->peak_rss = usage.ru_maxrss;
+	return ok;
+#else
+	result->peak_rss = 0;
+	return run_case (path, layers, n_layers, width, height, type, preset,
+			&result->encode_time, &result->decode_time, &result->size, error);
+#endif
+}
+
+int
+main (int    argc,
+		char **argv)
+{
+	GOptionContext *context;
+	GError         *error = NULL;
+	GArray         *size_list;
+	GArray         *preset_list;
+	gchar         **corpus_list;
+	gchar          *dir;
+	gchar          *path;
+	gboolean        first = TRUE;
+	gint            status = 0;
+	guint           s, c, p;
+
+	context = g_option_context_new ("- QWI encode/decode benchmark");
+	g_option_context_add_main_entries (context, entries, NULL);
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		g_printerr ("%s\n", error->message);
+		return 2;
+	}
+	g_option_context_free (context);
+
+	size_list = parse_list (sizes, "1,4,16", 0.001, 100);
+	preset_list = parse_list (presets, "0,1,2,3,4", 0, QWI_N_PRESETS - 1);
+	corpus_list = g_strsplit (corpora ? corpora : "gradient,noise,lineart,alpha,multilayer,animated", ",", -1);
+	repeat = MAX (1, repeat);
+	threads = MAX (1, threads);
+
+	dir = work_dir ? g_strdup (work_dir) : g_dir_make_tmp ("qwi-bench-XXXXXX", &error);
+	if (!dir) {
+		g_printerr ("%s\n", error->message);
+		return 1;
+	}
+	path = g_build_filename (dir, "bench.qwi", NULL);
+
+	printf ("{\n  \"simd\": \"%s\",\n  \"threads\": %d,\n  \"repeat\": %d,\n  \"seed\": %d,\n  \"results\": [",
+			qwi_simd_name (), threads, repeat, seed);
+
+	for (c = 0; corpus_list[c]; c++) {
+		Corpus corpus;
+
+		for (corpus = 0; corpus < N_CORPUS; corpus++)
+			if (!strcmp (corpus_list[c], corpus_names[corpus]))
+				break;
+		if (corpus == N_CORPUS) {
+			g_printerr ("Unknown corpus '%s'\n", corpus_list[c]);
+			status = 2;
+			continue;
+		}
+
+		for (s = 0; s < size_list->len; s++) {
+			QWICoreLayer *layers;
+			guint         n_layers;
+			guint32       width, height;
+			guchar        type;
+			gdouble       pixels = 0;
+			guint         i;
+
+			layers = make_corpus (corpus, g_array_index (size_list, gdouble, s), &n_layers, &width, &height, &type);
+			for (i = 0; i < n_layers; i++)
+				pixels += (gdouble) layers[i].width * layers[i].height;
+
+			for (p = 0; p < preset_list->len; p++) {
+				const QWIPreset *preset = &qwi_presets[(gint) g_array_index (preset_list, gdouble, p)];
+				CaseResult       result;
+
+				if (!run_case_isolated (path, layers, n_layers, width, height, type, preset, &result, &error)) {
+					g_printerr ("%s %ux%u %s: %s\n", corpus_names[corpus], width, height, preset->name, error->message);
+					g_clear_error (&error);
+					status = 1;
+					continue;
+				}
+
+				printf ("%s\n    { \"corpus\": \"%s\", \"width\": %u, \"height\": %u, \"layers\": %u, "
+						"\"megapixels\": %.3f, \"preset\": \"%s\", "
+						"\"encode_mps\": %.3f, \"decode_mps\": %.3f, \"bytes_per_pixel\": %.4f, "
+						"\"peak_rss_kb\": %ld }",
+						first ? "" : ",", corpus_names[corpus], width, height, n_layers,
+						pixels / 1e6, preset->name,
+						pixels / 1e6 / MAX (result.encode_time, 1e-6), pixels / 1e6 / MAX (result.decode_time, 1e-6),
+						result.size / pixels, result.peak_rss);
+				fflush (stdout);
+				first = FALSE;
+			}
+			qwi_core_layers_free (layers, n_layers);
+		}
+	}
+	printf ("\n  ]\n}\n");
+
+	g_unlink (path);
+	if (!work_dir)
+		g_rmdir (dir);
+	g_free (path);
+	g_free (dir);
+	g_strfreev (corpus_list);
+	g_array_free (size_list, TRUE);
+	g_array_free (preset_list, TRUE);
+	return status;
+}
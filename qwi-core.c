@@ -0,0 +1,462 @@
+/* qwi-core.c   QWI reading and writing without libgimp.             */
+
+/*
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "qwi.h"
+#include "qwi-input.h"
+#include "qwi-index.h"
+#include "qwi-optionals.h"
+#include "qwi-simd.h"
+#include "qwi-core.h"
+
+const QWIPreset qwi_presets[QWI_N_PRESETS] =
+{
+	{ "Drawing/diagram",    0, 100, 100,  1, 0 },
+	{ "Archive Lossless",   0, 100, 100,  0, 0 },
+	{ "Archive photo good", 0,  90, 100, -1, 1 },
+	{ "Web photo Good",     1,  90, 100, -1, 4 },
+	{ "Web photo smaller",  1,  80, 100, -1, 4 },
+};
+
+guint16
+qwi_core_set_duration (guint32 duration)
+{
+  if (duration < 164)
+    return 100*duration;
+  if (duration > 163830)
+    return 0x7fff;
+  return 0x4000 + (duration/10);
+}
+
+guint32
+qwi_core_get_duration (guint16 duration)
+{
+  if (duration & 0x4000)
+    return (duration&0x3fff)*10;
+  return (duration&0x3fff)/100;
+}
+
+gboolean
+qwi_core_read_header (QWIInput     *input,
+		const gchar  *filename,
+		QWI_ELEMENT  *element,
+		gchar       **code,
+		guint32      *code_length,
+		guint32      *qwi_error,
+		GError      **error)
+{
+	guchar   *buffer;
+	gboolean  parsed;
+
+	*code = NULL;
+	*code_length = 0;
+
+	/* Read the QWI file header */
+	buffer = qwi_input_read (input, QWI_FILE_HEADER_SIZE);
+	if (!buffer)
+	{
+		gchar *display = g_filename_display_name (filename);
+		g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+				"Error reading QWI file '%s'", display);
+		g_free (display);
+		return FALSE;
+	}
+	parsed = qwi_getFileHeader(element, buffer, qwi_error);
+	qwi_input_release(input, buffer);
+	if (!parsed) {
+		gchar *display = g_filename_display_name (filename);
+		g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+				"file '%s' seems not to be a QWI image", display);
+		g_free (display);
+		return FALSE;
+	}
+
+	/* manage File Optional sections here */
+	if (element->file.optionals) {
+		QWIOptional *sections;
+		guint        n_sections;
+
+		buffer = qwi_input_read (input, element->file.optionals);
+		if (!buffer)
+		{
+			gchar *display = g_filename_display_name (filename);
+			g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+					"Error reading QWI file '%s'", display);
+			g_free (display);
+			return FALSE;
+		}
+		// one walk over the sections, then the "PAG", "FNT" & "COD" ones go in a single exact size string
+		n_sections = qwi_optionals_scan (element, 0, buffer, element->file.optionals, &sections);
+		*code = qwi_optionals_code (element, buffer, sections, n_sections, code_length);
+		g_free (sections);
+		qwi_input_release(input, buffer);
+	}
+	return TRUE;
+}
+
+gchar *
+qwi_core_layer_name (QWI_ELEMENT  *element,
+		guchar       *bitstream,
+		gint          index,
+		const gchar  *filename)
+{
+	gchar   *layername = NULL;
+	guint32  qwi_error = 0;
+
+	if (bitstream) {
+		guint namesize, namelength = 0;
+		guint nameoffset = qwi_findOptionalSection(element, "NAM", 1, 0, bitstream, &namesize, &namelength);
+		if (namelength) {
+			qwi_getOptionalSection(element, 1, bitstream+nameoffset, (guchar**)(&layername), &namelength, &qwi_error);
+			return layername;
+		}
+	}
+
+	layername = malloc(128);
+	if (!index) {
+		if (element->file.type == QWI_TYPE_ANIMATE)
+			sprintf(layername, "Video frame %d (%dms)%s", index, qwi_core_get_duration(element->duration), element->duration&0x8000?" (combine)":"");
+		else if (element->file.type == QWI_TYPE_MULTILAYER)
+			sprintf(layername, "Background");
+		else
+			sprintf(layername, "Image %d", index);
+	}
+	else switch (element->file.type)
+	{
+	case QWI_TYPE_MULTILAYER:
+		sprintf(layername, "Layer %d", index);
+		break;
+	case QWI_TYPE_ANIMATE:
+		sprintf(layername, "Video frame %d (%dms)%s", index, qwi_core_get_duration(element->duration), element->duration&0x8000?" (combine)":"");
+		break;
+	case QWI_TYPE_SLIDESHOW:
+		sprintf(layername, "Image %d", index);
+		break;
+	default:
+		snprintf(layername, 128, "%s", filename);
+	}
+	return layername;
+}
+
+void
+qwi_core_decode (QWI_ELEMENT *element,
+		guchar      *bitstream,
+		gint         threads,
+		guchar       lowres,
+		QWIPool     *pool,
+		guchar      *dest,
+		guint32     *qwi_error)
+{
+	gshort *data[4] = {NULL, NULL, NULL, NULL};
+	guchar  plane;
+	gsize   size = (gsize) element->width * element->height * sizeof (gshort);
+
+	// the decoder works on full size planes, whatever the number of dropped levels
+	for (plane = 0; plane < element->planes; plane++)
+		if (!(data[plane] = qwi_pool_alloc (pool, size)))
+			*qwi_error = ENOMEM;
+	if (!*qwi_error)
+		qwi_decode_mt(element, threads, 0, element->toplayer-lowres, bitstream, data, (void*) dest, qwi_error);
+	for (plane = 0; plane < element->planes; plane++)
+		qwi_pool_release (pool, data[plane]);
+}
+
+void
+qwi_core_set_element (QWI_ELEMENT  *element,
+		guint32       width,
+		guint32       height,
+		gint          x,
+		gint          y,
+		guchar        planes,
+		gboolean      rgb,
+		const QWIEncodeParams *params)
+{
+	gboolean alpha = planes == (rgb ? 4 : 2);
+
+	// the alpha plane has a quality of its own (-1: the colour one)
+	qwi_setElement(element, width, height, x, y, planes, params->subsampling-1,
+			rgb ? QWI_COLORSPACE_RGBx : QWI_COLORSPACE_YUVx, 8,
+			params->quality, alpha ? params->qualityAlpha : -1, params->toplayer-1, 0, params->resiliency, params->duration);
+}
+
+gint
+qwi_core_max_layers (guint32 width,
+		guint32 height)
+{
+	gint layers = QWI_MAX_LAYERS-1;
+
+	// the top level stays at least 32 pixels wide and high
+	while (CEIL_RSHIFT(width, layers) < 32 && layers)
+		layers--;
+	while (CEIL_RSHIFT(height, layers) < 32 && layers)
+		layers--;
+	return layers + 1;
+}
+
+void
+qwi_core_preset_params (const QWIPreset *preset,
+		guint32          width,
+		guint32          height,
+		guchar           planes,
+		QWIEncodeParams *params)
+{
+	// same rules as the save dialog values get in WriteQWI
+	params->resiliency = preset->resiliency;
+	params->quality = preset->quality;
+	params->qualityAlpha = preset->qualityAlpha;
+	params->toplayer = preset->toplayer == 0 ? 0 : preset->toplayer == 1 ? 1 : qwi_core_max_layers (width, height);
+	params->subsampling = planes < 3 ? 1 : preset->subsampling;
+	params->duration = 0;
+}
+
+gsize
+qwi_core_encode_bound (guint32 width,
+		guint32 height,
+		guchar  planes)
+{
+	// we don't know how much, and expect that the compression process will not diverge too much...
+	return MAX (8192, (gsize) width * height * (planes + 1));
+}
+
+guint32
+qwi_core_encode (QWI_ELEMENT  *element,
+		gshort      **data,
+		guchar       *buffer,
+		guint32      *qwi_error)
+{
+	return qwi_encode (element, 1, 0, QWI_MAX_LAYERS, data, buffer, qwi_error);
+}
+
+void
+qwi_core_file_add_element (QWI_ELEMENT       *file,
+		const QWI_ELEMENT *element)
+{
+	file->file.top = MAX (file->file.top, element->toplayer);
+}
+
+QWICoreLayer *
+qwi_core_load (const gchar  *filename,
+		gint          threads,
+		guint        *n_layers,
+		QWI_ELEMENT  *element,
+		GError      **error)
+{
+	QWIPool      *pool = qwi_pool_new ();
+	QWIInput     *input;
+	QWIIndex     *index = NULL;
+	QWICoreLayer *layers = NULL;
+	gchar        *code = NULL;
+	guint32       code_length;
+	guint32       qwi_error = 0;
+	guint         i;
+
+	*n_layers = 0;
+	memset (element, 0, sizeof (QWI_ELEMENT));
+	input = qwi_input_open (filename, pool, error);
+	if (!input)
+		goto out;
+	if (!qwi_core_read_header (input, filename, element, &code, &code_length, &qwi_error, error))
+		goto out;
+	g_free (code);
+
+	index = qwi_index_scan (input, element, 0, error);
+	if (!index)
+		goto out;
+
+	layers = g_new0 (QWICoreLayer, MAX (index->n_entries, 1));
+	for (i = 0; i < index->n_entries; i++) {
+		QWIIndexEntry *entry = &index->entries[i];
+		QWICoreLayer  *layer = &layers[*n_layers];
+		QWI_ELEMENT    el = entry->element;
+		guchar        *bitstream;
+
+		if (!el.width)
+			continue;
+		bitstream = qwi_input_read_at (input, entry->offset, el.size);
+		if (!bitstream) {
+			g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Error reading QWI file");
+			goto fail;
+		}
+
+		layer->width = el.width;
+		layer->height = el.height;
+		layer->x = el.x;
+		layer->y = el.y;
+		layer->planes = el.planes;
+		layer->duration = el.duration;
+		layer->name = entry->name ? entry->name : qwi_core_layer_name (&el, input->mapped ? NULL : bitstream, i, filename);
+		entry->name = NULL;
+		layer->pixels = g_malloc ((gsize) el.width * el.height * el.planes);
+		(*n_layers)++;
+
+		qwi_core_decode (&el, bitstream, threads, 0, pool, layer->pixels, &qwi_error);
+		qwi_input_release (input, bitstream);
+		if (qwi_error) {
+			g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (qwi_error),
+					"Error while decoding element %u", i);
+			goto fail;
+		}
+	}
+	goto out;
+
+	fail:
+	qwi_core_layers_free (layers, *n_layers);
+	layers = NULL;
+	*n_layers = 0;
+
+	out:
+	if (index)
+		qwi_index_free (index);
+	if (input)
+		qwi_input_close (input);
+	qwi_pool_free (pool);
+	return layers;
+}
+
+gboolean
+qwi_core_save (const gchar        *filename,
+		const QWICoreLayer *layers,
+		guint               n_layers,
+		guint32             width,
+		guint32             height,
+		guchar              type,
+		const QWIEncodeParams *params,
+		const gchar        *code,
+		GError            **error)
+{
+	FILE        *outfile;
+	QWI_ELEMENT  element;
+	guchar       header[QWI_FILE_HEADER_SIZE];
+	guchar      *buffer = NULL;
+	gsize        buffer_size = 0;
+	gshort      *data[4] = {NULL, NULL, NULL, NULL};
+	gsize        data_size = 0;
+	guint32      qwi_error = 0;
+	gboolean     success = FALSE;
+	guint        i;
+
+	outfile = g_fopen (filename, "wb");
+	if (!outfile)
+	{
+		gchar *display = g_filename_display_name (filename);
+		g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+				"Could not open '%s' for writing: %s", display, g_strerror (errno));
+		g_free (display);
+		return FALSE;
+	}
+
+	memset(&element, 0, sizeof(QWI_ELEMENT));
+	element.file.type     = type;
+	element.file.width    = width;
+	element.file.height   = height;
+
+	// reserve some bytes for file header
+	fseek(outfile, QWI_FILE_HEADER_SIZE, SEEK_SET);
+	if (code && *code && !qwi_optionals_write (&element, code, outfile, error))
+		goto out;
+
+	for (i = 0; i < n_layers; i++) {
+		const QWICoreLayer *layer = &layers[i];
+		gsize               pixels = (gsize) layer->width * layer->height;
+		guint32             length;
+		guint               row;
+		guchar              plane;
+
+		if (buffer_size < qwi_core_encode_bound (layer->width, layer->height, layer->planes)) {
+			g_free (buffer);
+			buffer_size = qwi_core_encode_bound (layer->width, layer->height, layer->planes);
+			buffer = g_malloc (buffer_size);
+		}
+		if (data_size < layer->planes * pixels * sizeof (gshort)) {
+			g_free (data[0]);
+			data_size = layer->planes * pixels * sizeof (gshort);
+			data[0] = g_malloc (data_size);
+		}
+		for (plane = 1; plane < layer->planes; plane++)
+			data[plane] = data[plane-1] + pixels;
+
+		qwi_core_set_element (&element, layer->width, layer->height, layer->x, layer->y,
+				layer->planes, layer->planes > 2, params);
+		if (element.file.type == QWI_TYPE_ANIMATE) {
+			if (layer->duration)
+				element.duration = layer->duration;
+		}
+		else if ((element.file.type&1) && layer->name)
+			qwi_setOptionalSection(&element, "NAM", 1, strlen(layer->name), (uint8_t*)layer->name, buffer, &qwi_error);
+
+		for (row = 0; row < layer->height; row++) {
+			gshort *dst[4];
+			for (plane = 0; plane < layer->planes; plane++)
+				dst[plane] = data[plane] + (gsize) row * layer->width;
+			qwi_deinterleave (layer->pixels + (gsize) row * layer->width * layer->planes, layer->planes, dst, layer->width);
+		}
+
+		length = qwi_core_encode (&element, data, buffer, &qwi_error);
+		if (qwi_error) {
+			g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (qwi_error),
+					"Error while encoding element %u", i);
+			goto out;
+		}
+		if (fwrite (buffer, length, 1, outfile) != 1) {
+			g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+					"Error writing QWI file: %s", g_strerror (errno));
+			goto out;
+		}
+		qwi_core_file_add_element (&element, &element);
+	}
+
+	// write the file header, now that it is valid
+	fseek(outfile, 0, SEEK_SET);
+	qwi_setFileHeader(&element, header);
+	success = fwrite (header, QWI_FILE_HEADER_SIZE, 1, outfile) == 1 && fflush (outfile) == 0;
+	if (!success)
+		g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+				"Error writing QWI file: %s", g_strerror (errno));
+
+	out:
+	g_free (data[0]);
+	g_free (buffer);
+	fclose (outfile);
+	// no half written file is left behind
+	if (!success)
+		g_unlink (filename);
+	return success;
+}
+
+void
+qwi_core_layers_free (QWICoreLayer *layers,
+		guint         n_layers)
+{
+	guint i;
+
+	for (i = 0; i < n_layers; i++) {
+		free (layers[i].name);
+		g_free (layers[i].pixels);
+	}
+	g_free (layers);
+}
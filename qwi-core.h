@@ -0,0 +1,164 @@
+/*
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __QWI_CORE_H__
+#define __QWI_CORE_H__
+
+/* The codec facing part of the plug-in, free of libgimp: the GIMP
+ * procedures and qwi-tool are both built on it.
+ * needs stdio.h, qwi.h and qwi-input.h
+ */
+
+#ifndef CEIL_RSHIFT
+#define CEIL_RSHIFT(a,b) (((a) + (1<<b)-1) >> b)
+#endif
+
+/* Encoder settings, as picked in the save dialog */
+typedef struct
+{
+  gint      subsampling;   /* 1 (none) .. 4 */
+  gint      resiliency;    /* 0 .. 2 */
+  gint      toplayer;      /* number of resolution levels */
+  gint      quality;       /* 0 .. 100 */
+  gint      qualityAlpha;  /* 0 .. 100 */
+  guint16   duration;      /* frame duration, see qwi_core_set_duration */
+} QWIEncodeParams;
+
+/* The save dialog presets */
+typedef struct
+{
+  const gchar *name;
+  gint         resiliency;
+  gint         quality;
+  gint         qualityAlpha;
+  gint         toplayer;      /* -1 = as many levels as the size allows */
+  gint         subsampling;
+} QWIPreset;
+
+#define QWI_N_PRESETS  5
+
+extern const QWIPreset qwi_presets[QWI_N_PRESETS];
+
+/* One element of a file, with its pixels */
+typedef struct
+{
+  guint32   width;
+  guint32   height;
+  gint      x;
+  gint      y;
+  guchar    planes;        /* 1 gray, 2 gray + alpha, 3 RGB, 4 RGBA */
+  guint16   duration;
+  gchar    *name;          /* malloc'd, may be NULL */
+  guchar   *pixels;        /* width * height * planes, interleaved, g_malloc'd */
+} QWICoreLayer;
+
+/* Frame durations: milliseconds to and from the 16 bit element field */
+guint16        qwi_core_set_duration   (guint32             duration);
+guint32        qwi_core_get_duration   (guint16             duration);
+
+/* Reads the file header and the file optionals. code (nul terminated,
+ * g_malloc'd) gets the <page>, <font> and <code> sections, NULL when
+ * there is none. qwi_error is set when the file format is newer than
+ * the library, which may still decode it.
+ */
+gboolean       qwi_core_read_header    (QWIInput           *input,
+                                        const gchar        *filename,
+                                        QWI_ELEMENT        *element,
+                                        gchar             **code,
+                                        guint32            *code_length,
+                                        guint32            *qwi_error,
+                                        GError            **error);
+
+/* Name of the index-th element: its NAM section when bitstream is given
+ * and has one, else a name from the file type. malloc'd.
+ */
+gchar         *qwi_core_layer_name     (QWI_ELEMENT        *element,
+                                        guchar             *bitstream,
+                                        gint                index,
+                                        const gchar        *filename);
+
+/* Decodes an element bitstream into dest, dropping lowres resolution
+ * levels: CEIL_RSHIFT (width, lowres) * CEIL_RSHIFT (height, lowres)
+ * interleaved pixels. The decoder planes come from pool.
+ */
+void           qwi_core_decode         (QWI_ELEMENT        *element,
+                                        guchar             *bitstream,
+                                        gint                threads,
+                                        guchar              lowres,
+                                        QWIPool            *pool,
+                                        guchar             *dest,
+                                        guint32            *qwi_error);
+
+/* Sets up element for a width x height layer at x, y. rgb picks the RGB
+ * colorspace over the gray one. The alpha plane, if any, is coded at
+ * params->qualityAlpha and the others at params->quality.
+ */
+void           qwi_core_set_element    (QWI_ELEMENT        *element,
+                                        guint32             width,
+                                        guint32             height,
+                                        gint                x,
+                                        gint                y,
+                                        guchar              planes,
+                                        gboolean            rgb,
+                                        const QWIEncodeParams *params);
+
+/* Largest number of resolution levels for a width x height image */
+gint           qwi_core_max_layers     (guint32             width,
+                                        guint32             height);
+
+/* Encoder settings of a preset, for a width x height image of planes */
+void           qwi_core_preset_params  (const QWIPreset    *preset,
+                                        guint32             width,
+                                        guint32             height,
+                                        guchar              planes,
+                                        QWIEncodeParams    *params);
+
+/* Size of the bitstream buffer qwi_core_encode is handed */
+gsize          qwi_core_encode_bound   (guint32             width,
+                                        guint32             height,
+                                        guchar              planes);
+guint32        qwi_core_encode         (QWI_ELEMENT        *element,
+                                        gshort            **data,
+                                        guchar             *buffer,
+                                        guint32            *qwi_error);
+
+/* File header bookkeeping once an element is written: the file top level
+ * is the highest of its elements, which scaled and thumbnail loads rely on.
+ */
+void           qwi_core_file_add_element (QWI_ELEMENT      *file,
+                                        const QWI_ELEMENT  *element);
+
+/* Whole files, for tools: elements come bottom first. */
+QWICoreLayer  *qwi_core_load           (const gchar        *filename,
+                                        gint                threads,
+                                        guint              *n_layers,
+                                        QWI_ELEMENT        *element,
+                                        GError            **error);
+gboolean       qwi_core_save           (const gchar        *filename,
+                                        const QWICoreLayer *layers,
+                                        guint               n_layers,
+                                        guint32             width,
+                                        guint32             height,
+                                        guchar              type,
+                                        const QWIEncodeParams *params,
+                                        const gchar        *code,
+                                        GError            **error);
+void           qwi_core_layers_free    (QWICoreLayer       *layers,
+                                        guint               n_layers);
+
+#endif /* __QWI_CORE_H__ */
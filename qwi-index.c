@@ -0,0 +1,102 @@
+/* qwi-index.c  Header-only scan of the elements of a QWI file.       */
+
+/*
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <glib.h>
+
+#include "qwi.h"
+#include "qwi-input.h"
+#include "qwi-index.h"
+
+QWIIndex *
+qwi_index_scan (QWIInput     *input,
+		QWI_ELEMENT  *element,
+		guint         max_entries,
+		GError      **error)
+{
+	QWIIndex *index = g_new0 (QWIIndex, 1);
+	GArray   *entries;
+	guint     n = element->file.elements;
+
+	if (max_entries && max_entries < n)
+		n = max_entries;
+	// the count comes from the file: the array grows with the elements actually there
+	entries = g_array_sized_new (FALSE, TRUE, sizeof (QWIIndexEntry), CLAMP (n, 1, 64));
+
+	while (entries->len < n) {
+		QWIIndexEntry  entry = { 0 };
+		gsize          header_size = element->file.split && element->file.base ? QWI_ELEMENT_SHORT_HEADER_SIZE : QWI_ELEMENT_HEADER_SIZE;
+		guchar        *buffer;
+		gboolean       parsed;
+
+		buffer = qwi_input_read (input, header_size);
+		if (!buffer) {
+			g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Error reading QWI file");
+			goto fail;
+		}
+		parsed = qwi_getElementHeader (element, buffer);
+		qwi_input_release (input, buffer);
+		if (!parsed) {
+			g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "QWI file seems corrupted or is incompatible with current software");
+			goto fail;
+		}
+
+		entry.element = *element;
+		entry.offset = qwi_input_tell (input);
+
+		// the layer name is at the start of the bitstream: only look at it when it costs no read
+		if (input->mapped && element->width && element->size <= input->size - entry.offset) {
+			guint32 namesize, namelength, qwi_error = 0;
+			guchar *bitstream = input->data + entry.offset;
+			guint32 nameoffset = qwi_findOptionalSection (&entry.element, "NAM", 1, 0, bitstream, &namesize, &namelength);
+			if (namelength)
+				qwi_getOptionalSection (&entry.element, 1, bitstream + nameoffset, (guchar **) &entry.name, &namelength, &qwi_error);
+		}
+		g_array_append_val (entries, entry);
+
+		if (!qwi_input_skip (input, element->size)) {
+			g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Error reading QWI file");
+			goto fail;
+		}
+	}
+	index->n_entries = entries->len;
+	index->entries = (QWIIndexEntry *) g_array_free (entries, FALSE);
+	return index;
+
+fail:
+	index->n_entries = entries->len;
+	index->entries = (QWIIndexEntry *) g_array_free (entries, FALSE);
+	qwi_index_free (index);
+	return NULL;
+}
+
+void
+qwi_index_free (QWIIndex *index)
+{
+	guint i;
+
+	for (i = 0; i < index->n_entries; i++)
+		free (index->entries[i].name);
+	g_free (index->entries);
+	g_free (index);
+}
@@ -0,0 +1,54 @@
+/*
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __QWI_INDEX_H__
+#define __QWI_INDEX_H__
+
+/* needs qwi.h and qwi-input.h */
+
+/* One element of a QWI file, as found by the header scan */
+typedef struct
+{
+  QWI_ELEMENT  element;   /* element as left by qwi_getElementHeader */
+  gsize        offset;    /* of the bitstream, in the file */
+  gchar       *name;      /* NAM section, NULL when absent or not mapped */
+} QWIIndexEntry;
+
+/* The element table of a QWI file: width, height, planes, x, y, duration
+ * and bitstream size are all in each entry's element.
+ */
+typedef struct
+{
+  guint          n_entries;
+  QWIIndexEntry *entries;
+} QWIIndex;
+
+/* Walks the element headers from the current input position, seeking past
+ * the bitstreams, so the cost is in the number of elements, not the size
+ * of the file. element holds the file header and is updated as headers
+ * are parsed. max_entries stops the scan early (0 = all the elements).
+ * Layer names are only picked up when the file is mapped, since they live
+ * at the start of the bitstreams.
+ */
+QWIIndex  *qwi_index_scan  (QWIInput     *input,
+                            QWI_ELEMENT  *element,
+                            guint         max_entries,
+                            GError      **error);
+void       qwi_index_free  (QWIIndex     *index);
+
+#endif /* __QWI_INDEX_H__ */
@@ -0,0 +1,144 @@
+/* qwi-input.c  Zero-copy (memory mapped) reading of QWI files.      */
+
+/*
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <errno.h>
+#include <stdio.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "qwi-input.h"
+
+QWIInput *
+qwi_input_open (const gchar  *filename,
+		QWIPool      *pool,
+		GError      **error)
+{
+	QWIInput *input = g_new0 (QWIInput, 1);
+
+	input->pool = pool;
+
+	// the mapping is private and writable: libqwi takes non-const buffers,
+	// any page it would touch gets copied instead of reaching the file
+	if (!g_getenv ("QWI_NO_MMAP"))
+		input->mapped = g_mapped_file_new (filename, TRUE, NULL);
+
+	if (input->mapped) {
+		input->data = (guchar *) g_mapped_file_get_contents (input->mapped);
+		input->size = g_mapped_file_get_length (input->mapped);
+		return input;
+	}
+
+	input->fd = g_fopen (filename, "rb");
+	if (!input->fd) {
+		gchar *display_name = g_filename_display_name (filename);
+
+		g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+				"Could not open '%s' for reading: %s",
+				display_name, g_strerror (errno));
+		g_free (display_name);
+		g_free (input);
+		return NULL;
+	}
+	return input;
+}
+
+void
+qwi_input_close (QWIInput *input)
+{
+	if (input->mapped)
+		g_mapped_file_unref (input->mapped);
+	if (input->fd)
+		fclose (input->fd);
+	g_free (input);
+}
+
+guchar *
+qwi_input_read (QWIInput *input,
+		gsize     len)
+{
+	guchar *buffer;
+
+	if (input->mapped) {
+		if (len > input->size - input->offset)
+			return NULL;
+		buffer = input->data + input->offset;
+		input->offset += len;
+		return buffer;
+	}
+
+	buffer = input->pool ? qwi_pool_alloc (input->pool, len) : g_malloc (MAX (len, 1));
+	if (!buffer)
+		return NULL;
+	if (len && fread (buffer, len, 1, input->fd) != 1) {
+		qwi_input_release (input, buffer);
+		return NULL;
+	}
+	return buffer;
+}
+
+guchar *
+qwi_input_read_at (QWIInput *input,
+		gsize     offset,
+		gsize     len)
+{
+	if (input->mapped) {
+		if (offset > input->size)
+			return NULL;
+		input->offset = offset;
+	}
+	else if (fseek (input->fd, offset, SEEK_SET) != 0)
+		return NULL;
+	return qwi_input_read (input, len);
+}
+
+void
+qwi_input_release (QWIInput *input,
+		guchar   *buffer)
+{
+	if (input->mapped)
+		return;
+	if (input->pool)
+		qwi_pool_release (input->pool, buffer);
+	else
+		g_free (buffer);
+}
+
+gboolean
+qwi_input_skip (QWIInput *input,
+		gsize     len)
+{
+	if (input->mapped) {
+		if (len > input->size - input->offset)
+			return FALSE;
+		input->offset += len;
+		return TRUE;
+	}
+	return fseek (input->fd, len, SEEK_CUR) == 0;
+}
+
+gsize
+qwi_input_tell (QWIInput *input)
+{
+	if (input->mapped)
+		return input->offset;
+	return ftell (input->fd);
+}
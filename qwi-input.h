@@ -0,0 +1,57 @@
+/*
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __QWI_INPUT_H__
+#define __QWI_INPUT_H__
+
+#include "qwi-pool.h"
+
+/* A QWI file opened for reading. When the file can be memory mapped,
+ * qwi_input_read hands out pointers straight into the mapping; otherwise
+ * it falls back to fread into buffers taken from the pool (or the heap).
+ */
+typedef struct
+{
+  QWIPool     *pool;
+  FILE        *fd;        /* fread fallback, NULL when mapped */
+  GMappedFile *mapped;
+  guchar      *data;      /* mapped contents */
+  gsize        size;
+  gsize        offset;    /* current position in the mapping */
+} QWIInput;
+
+QWIInput  *qwi_input_open     (const gchar  *filename,
+                               QWIPool      *pool,
+                               GError      **error);
+void       qwi_input_close    (QWIInput     *input);
+
+/* Returns the next len bytes, or NULL at end of file. The buffer must be
+ * given back with qwi_input_release once the caller is done with it.
+ */
+guchar    *qwi_input_read     (QWIInput     *input,
+                               gsize         len);
+void       qwi_input_release  (QWIInput     *input,
+                               guchar       *buffer);
+guchar    *qwi_input_read_at  (QWIInput     *input,
+                               gsize         offset,
+                               gsize         len);
+gboolean   qwi_input_skip     (QWIInput     *input,
+                               gsize         len);
+gsize      qwi_input_tell     (QWIInput     *input);
+
+#endif /* __QWI_INPUT_H__ */
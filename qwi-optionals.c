@@ -0,0 +1,211 @@
+/* qwi-optionals.c  Single pass access to QWI optional sections.     */
+
+/*
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "qwi.h"
+#include "qwi-optionals.h"
+
+#define CODE_SECTIONS  3
+
+static const struct
+{
+	const gchar *tag;
+	const gchar *open;
+	const gchar *close;
+} code_sections[CODE_SECTIONS] =
+{
+	{ "PAG", "<page>", "</page>" },
+	{ "FNT", "<font>", "</font>" },
+	{ "COD", "<code>", "</code>" },
+};
+
+guint
+qwi_optionals_scan (QWI_ELEMENT  *element,
+		gint          level,
+		guchar       *buffer,
+		guint32       buffer_size,
+		QWIOptional **sections)
+{
+	GArray  *array = g_array_new (FALSE, FALSE, sizeof (QWIOptional));
+	guint32  offset = 0;
+	guint    n;
+
+	while (offset + 4 <= buffer_size) {
+		QWIOptional section;
+
+		// searching for the tag the section at offset has finds that very section: no payload is touched
+		memcpy (section.tag, buffer + offset + 1, 3);
+		section.tag[3] = 0;
+		section.offset = qwi_findOptionalSection (element, section.tag, level, offset, buffer, &section.size, &section.length);
+		if (section.offset != offset || !section.size || !section.length || section.size > buffer_size - offset)
+			break;
+		g_array_append_val (array, section);
+		offset += section.size;
+	}
+
+	n = array->len;
+	*sections = (QWIOptional *) g_array_free (array, FALSE);
+	return n;
+}
+
+gchar *
+qwi_optionals_code (QWI_ELEMENT       *element,
+		guchar            *buffer,
+		const QWIOptional *sections,
+		guint              n_sections,
+		guint32           *code_length)
+{
+	gchar   *code;
+	gchar   *end;
+	guint32  length = 0;
+	guint32  qwi_error = 0;
+	guint    i, j;
+
+	for (i = 0; i < n_sections; i++)
+		for (j = 0; j < G_N_ELEMENTS (code_sections); j++)
+			if (!strcmp (sections[i].tag, code_sections[j].tag))
+				length += strlen (code_sections[j].open) + sections[i].length + strlen (code_sections[j].close);
+
+	*code_length = length;
+	if (!length)
+		return NULL;
+
+	code = end = g_malloc (length + 1);
+	for (i = 0; i < n_sections; i++)
+		for (j = 0; j < G_N_ELEMENTS (code_sections); j++)
+			if (!strcmp (sections[i].tag, code_sections[j].tag)) {
+				guchar  *payload = NULL;
+				guint32  payload_length = 0;
+
+				// extracting the payload is the library's business: it may be compressed
+				end = g_stpcpy (end, code_sections[j].open);
+				qwi_getOptionalSection (element, 0, buffer + sections[i].offset, &payload, &payload_length, &qwi_error);
+				payload_length = payload ? MIN (payload_length, sections[i].length) : 0;
+				if (payload_length)
+					memcpy (end, payload, payload_length);
+				free (payload);
+				end = g_stpcpy (end + payload_length, code_sections[j].close);
+			}
+	*code_length = end - code;
+	return code;
+}
+
+// reads back the section just encoded at the start of buffer, before it is written
+static gboolean
+section_check (QWI_ELEMENT  *element,
+		const gchar  *tag,
+		const gchar  *data,
+		guint32       length,
+		guchar       *buffer,
+		guint32       size)
+{
+	guchar   *payload = NULL;
+	guint32   payload_length = 0;
+	guint32   found_size = 0;
+	guint32   found_length = 0;
+	guint32   qwi_error = 0;
+	gboolean  same;
+
+	if (qwi_findOptionalSection (element, tag, 0, 0, buffer, &found_size, &found_length) != 0
+			|| found_size != size || found_length != length)
+		return FALSE;
+	qwi_getOptionalSection (element, 0, buffer, &payload, &payload_length, &qwi_error);
+	same = payload && payload_length == length && !memcmp (payload, data, length);
+	free (payload);
+	return same;
+}
+
+gboolean
+qwi_optionals_write (QWI_ELEMENT  *element,
+		const gchar  *code,
+		FILE         *outfile,
+		GError      **error)
+{
+	const gchar *resume[CODE_SECTIONS] = { code, code, code };
+	const gchar *p;
+	guchar      *buffer = NULL;
+	gsize        buffer_size = 0;
+	guint32      optionals = 0;
+	guint32      qwi_error = 0;
+	gboolean     success = TRUE;
+
+	// one pass over the string; like the old per kind scans, a kind starts again after its last
+	// closing tag, so a tag inside a section of another kind still makes a section
+	for (p = strchr (code, '<'); success && p; p = strchr (p + 1, '<')) {
+		const gchar *data;
+		const gchar *end;
+		guint32      length;
+		guint32      size;
+		guint        kind;
+
+		for (kind = 0; kind < CODE_SECTIONS; kind++)
+			if (p >= resume[kind] && g_str_has_prefix (p, code_sections[kind].open))
+				break;
+		if (kind == CODE_SECTIONS)
+			continue;
+
+		data = p + strlen (code_sections[kind].open);
+		end = strstr (data, code_sections[kind].close);
+		if (!end) {
+			g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+					"Missing %s tag in code", code_sections[kind].close);
+			success = FALSE;
+			break;
+		}
+		resume[kind] = end;
+		length = end - data;
+		// the loader stops at an empty section
+		if (!length)
+			continue;
+
+		// each section is encoded alone at the start of the buffer, and written as soon as it is parsed
+		if (buffer_size < (gsize) length + 256) {
+			g_free (buffer);
+			buffer_size = (gsize) length + 256;
+			buffer = g_malloc (buffer_size);
+		}
+		element->file.optionals = 0;
+		qwi_setOptionalSection (element, code_sections[kind].tag, 0, length, (uint8_t*) data, buffer, &qwi_error);
+		size = element->file.optionals;
+		if (!size || size > buffer_size
+				|| !section_check (element, code_sections[kind].tag, data, length, buffer, size)) {
+			g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+					"Error encoding the %s section of code", code_sections[kind].open);
+			success = FALSE;
+		} else if (fwrite (buffer, size, 1, outfile) != 1) {
+			g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+					"Error writing file optionals: %s", g_strerror (errno));
+			success = FALSE;
+		}
+		optionals += size;
+	}
+
+	// patched into the file header with the rest of it
+	element->file.optionals = optionals;
+	g_free (buffer);
+	return success;
+}
@@ -0,0 +1,64 @@
+/*
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __QWI_OPTIONALS_H__
+#define __QWI_OPTIONALS_H__
+
+/* needs stdio.h and qwi.h */
+
+/* One optional section of a file or element optionals block */
+typedef struct
+{
+  gchar    tag[4];    /* "PAG", "FNT", "COD", "NAM", ... nul terminated */
+  guint32  offset;    /* of the section, in the block */
+  guint32  size;      /* of the section, in the block */
+  guint32  length;    /* of the payload, once extracted */
+} QWIOptional;
+
+/* Walks an optionals block once, whatever the section tags, and fills
+ * sections with a g_malloc'd array. Returns the number of sections.
+ */
+guint      qwi_optionals_scan   (QWI_ELEMENT        *element,
+                                 gint                level,
+                                 guchar             *buffer,
+                                 guint32             buffer_size,
+                                 QWIOptional       **sections);
+
+/* Assembles the <page>, <font> and <code> sections of a file optionals
+ * block, in file order, into one nul terminated string for the "code"
+ * parasite. NULL when there is none of them.
+ */
+gchar     *qwi_optionals_code   (QWI_ELEMENT        *element,
+                                 guchar             *buffer,
+                                 const QWIOptional  *sections,
+                                 guint               n_sections,
+                                 guint32            *code_length);
+
+/* Writes the <page>, <font> and <code> sections of a "code" string to
+ * outfile as "PAG", "FNT" and "COD" file optionals, in one pass over the
+ * string: each section is encoded, read back and written as soon as its
+ * closing tag is found, in string order. A tag inside a section of another
+ * kind still makes a section. element->file.optionals is left with the
+ * size of the whole block, for the file header.
+ */
+gboolean   qwi_optionals_write  (QWI_ELEMENT        *element,
+                                 const gchar        *code,
+                                 FILE               *outfile,
+                                 GError            **error);
+
+#endif /* __QWI_OPTIONALS_H__ */
@@ -0,0 +1,172 @@
+/* qwi-pool.c   Size-class scratch memory reused across elements.     */
+
+/*
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <stdlib.h>
+#if !defined(WIN32) && !defined(__MINGW32__)
+#include <sys/resource.h>
+#else
+#include <malloc.h>
+#endif
+
+#include <glib.h>
+
+#include "qwi-pool.h"
+
+#define POOL_ALIGN      64
+#define POOL_CLASSES    (4 * (8 * (gint) sizeof (gsize) - 13))   /* 4 per power of two, from 4KiB up */
+#define POOL_FALLBACK   2       /* larger classes a request may take a free block from */
+
+// sits in the POOL_ALIGN bytes in front of every block
+typedef struct _QWIBlock QWIBlock;
+struct _QWIBlock
+{
+	guint     size_class;
+	QWIBlock *next;
+};
+
+struct _QWIPool
+{
+	GMutex        mutex;
+	QWIBlock     *free_blocks[POOL_CLASSES];
+	QWIPoolStats  stats;
+};
+
+static gsize
+class_size (guint size_class)
+{
+	return (gsize) (4 + size_class % 4) << (10 + size_class / 4);
+}
+
+static void
+get_faults (glong *minor,
+		glong *major)
+{
+#if !defined(WIN32) && !defined(__MINGW32__)
+	struct rusage usage;
+
+	getrusage (RUSAGE_SELF, &usage);
+	*minor = usage.ru_minflt;
+	*major = usage.ru_majflt;
+#else
+	*minor = *major = 0;
+#endif
+}
+
+QWIPool *
+qwi_pool_new (void)
+{
+	QWIPool *pool = g_new0 (QWIPool, 1);
+
+	g_mutex_init (&pool->mutex);
+	get_faults (&pool->stats.minor_faults, &pool->stats.major_faults);
+	return pool;
+}
+
+void
+qwi_pool_free (QWIPool *pool)
+{
+	guint size_class;
+
+	for (size_class = 0; size_class < POOL_CLASSES; size_class++)
+		while (pool->free_blocks[size_class]) {
+			QWIBlock *block = pool->free_blocks[size_class];
+			pool->free_blocks[size_class] = block->next;
+#if defined(WIN32) || defined(__MINGW32__)
+			_aligned_free (block);
+#else
+			free (block);
+#endif
+		}
+	g_mutex_clear (&pool->mutex);
+	g_free (pool);
+}
+
+gpointer
+qwi_pool_alloc (QWIPool *pool,
+		gsize    size)
+{
+	QWIBlock *block = NULL;
+	guint     size_class = 0;
+	guint     larger;
+
+	while (size_class < POOL_CLASSES && class_size (size_class) < size)
+		size_class++;
+	if (size_class == POOL_CLASSES)
+		return NULL;
+
+	// a free block of a slightly larger class beats faulting in a new one, a much larger one is left for its own size
+	g_mutex_lock (&pool->mutex);
+	pool->stats.requests++;
+	for (larger = size_class; larger <= size_class + POOL_FALLBACK && larger < POOL_CLASSES && !block; larger++) {
+		block = pool->free_blocks[larger];
+		if (block) {
+			pool->free_blocks[larger] = block->next;
+			pool->stats.reused++;
+		}
+	}
+	g_mutex_unlock (&pool->mutex);
+
+	if (!block) {
+#if defined(WIN32) || defined(__MINGW32__)
+		block = _aligned_malloc (POOL_ALIGN + class_size (size_class), POOL_ALIGN);
+#else
+		block = aligned_alloc (POOL_ALIGN, POOL_ALIGN + class_size (size_class));
+#endif
+		if (!block)
+			return NULL;
+		block->size_class = size_class;
+
+		g_mutex_lock (&pool->mutex);
+		pool->stats.allocated_bytes += class_size (size_class);
+		g_mutex_unlock (&pool->mutex);
+	}
+	return (guchar *) block + POOL_ALIGN;
+}
+
+void
+qwi_pool_release (QWIPool  *pool,
+		gpointer  mem)
+{
+	QWIBlock *block;
+
+	if (!mem)
+		return;
+	block = (QWIBlock *) ((guchar *) mem - POOL_ALIGN);
+
+	g_mutex_lock (&pool->mutex);
+	block->next = pool->free_blocks[block->size_class];
+	pool->free_blocks[block->size_class] = block;
+	g_mutex_unlock (&pool->mutex);
+}
+
+void
+qwi_pool_get_stats (QWIPool      *pool,
+		QWIPoolStats *stats)
+{
+	glong minor, major;
+
+	get_faults (&minor, &major);
+	g_mutex_lock (&pool->mutex);
+	*stats = pool->stats;
+	g_mutex_unlock (&pool->mutex);
+	stats->minor_faults = minor - stats->minor_faults;
+	stats->major_faults = major - stats->major_faults;
+}
@@ -0,0 +1,51 @@
+/*
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __QWI_POOL_H__
+#define __QWI_POOL_H__
+
+/* Scratch memory shared by all the elements of a load. Released blocks go
+ * back to a free list per size class and are handed out again to the next
+ * element, so memory is only allocated (and its pages only faulted in)
+ * when a larger element comes in, a request being served from one of the
+ * next two classes (at most 1.5 times its size) when its own is
+ * empty. Blocks are 64 byte aligned, and the pool
+ * may be used from several threads. qwi_pool_alloc returns NULL when the
+ * memory can't be had.
+ */
+typedef struct _QWIPool QWIPool;
+
+typedef struct
+{
+  guint64  requests;         /* qwi_pool_alloc calls */
+  guint64  reused;           /* ... served from a free list */
+  guint64  allocated_bytes;  /* memory obtained from the system */
+  glong    minor_faults;     /* page faults since the pool was created */
+  glong    major_faults;
+} QWIPoolStats;
+
+QWIPool   *qwi_pool_new        (void);
+void       qwi_pool_free       (QWIPool      *pool);
+gpointer   qwi_pool_alloc      (QWIPool      *pool,
+                                gsize         size);
+void       qwi_pool_release    (QWIPool      *pool,
+                                gpointer      mem);
+void       qwi_pool_get_stats  (QWIPool      *pool,
+                                QWIPoolStats *stats);
+
+#endif /* __QWI_POOL_H__ */
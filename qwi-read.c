@@ -19,7 +19,6 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  * ----------------------------------------------------------------------------
  */
-#include <time.h>
 
 //#include "config.h"
 
@@ -32,6 +31,11 @@
 
 #include "file-qwi.h"
 #include "qwi.h"
+#include "qwi-input.h"
+#include "qwi-index.h"
+#include "qwi-core.h"
+#include "qwi-stats.h"
+#include "qwi-trace.h"
 #include "stdlib.h"
 
 //#include "libgimp/stdplugins-intl.h"
@@ -47,80 +51,258 @@
 
 static GimpParasite *code_parasite = NULL;
 
-static guint32 get_duration (guint16 duration) 
+/* A rectangle of the image, in full resolution pixels */
+typedef struct
 {
-  if (duration & 0x4000)
-    return (duration&0x3fff)*10;
-  return (duration&0x3fff)/100;
+	gint x, y, width, height;
+} QWIRect;
+
+/* The part of an element that ends up in its layer */
+typedef struct
+{
+	gint x, y, width, height;   /* in the decoded element */
+	gint layer_x, layer_y;      /* layer offsets in the (scaled) image */
+} QWICrop;
+
+/* Where an element lands in the region of interest. Returns FALSE when it
+ * does not intersect it. element_lowres is the number of levels dropped
+ * for this element, lowres the one of the image.
+ */
+static gboolean
+get_crop (const QWI_ELEMENT *element,
+		const QWIRect     *region,
+		guchar             element_lowres,
+		guchar             lowres,
+		QWICrop           *crop)
+{
+	gint x0 = MAX ((gint) element->x, region->x);
+	gint y0 = MAX ((gint) element->y, region->y);
+	gint x1 = MIN ((gint) (element->x + element->width), region->x + region->width);
+	gint y1 = MIN ((gint) (element->y + element->height), region->y + region->height);
+
+	if (x0 >= x1 || y0 >= y1)
+		return FALSE;
+
+	crop->x = (x0 - (gint) element->x) >> element_lowres;
+	crop->y = (y0 - (gint) element->y) >> element_lowres;
+	crop->width = MAX (1, CEIL_RSHIFT(x1 - (gint) element->x, element_lowres) - crop->x);
+	crop->height = MAX (1, CEIL_RSHIFT(y1 - (gint) element->y, element_lowres) - crop->y);
+	crop->layer_x = (x0 - region->x) >> lowres;
+	crop->layer_y = (y0 - region->y) >> lowres;
+	return TRUE;
 }
 
+/* One element travelling through the decoder pool */
+typedef struct
+{
+	QWI_ELEMENT    element;     /* private copy of the element header */
+	gint           index;       /* element number in the file */
+	gint           threads;     /* threads given to qwi_decode_mt */
+	guchar         lowres;      /* number of dropped resolution levels */
+	QWIInput      *input;
+	QWIPool       *scratch;
+	guchar        *buffer;      /* element bitstream, released once decoded */
+	guchar        *dest;        /* decoded pixels */
+	gchar         *layername;
+	GimpImageType  type;
+	QWICrop        crop;        /* part of the decoded element going to the layer */
+	QWIStats      *stats;
+	guint32        qwi_error;
+	gboolean       done;
+} QWIDecodeJob;
+
+static GMutex   decode_mutex;
+static GCond    decode_cond;
+
+static void
+decode_job (gpointer job_data,
+		gpointer user_data)
+{
+	QWIDecodeJob *job = job_data;
+	QWI_ELEMENT  *element = &job->element;
+	gint64        begin;
+
+  // get aligned memory for the output from the scratch pool (the decoder takes its planes from there too)
+	job->dest = qwi_pool_alloc (job->scratch, (gsize) element->width * element->height * element->planes);
+	if (!job->dest)
+		job->qwi_error = ENOMEM;
+
+	// decode (the per element time, and the thread count, are in the QWI_STATS record)
+	begin = qwi_stats_begin (job->stats);
+	if (!job->qwi_error)
+		qwi_core_decode (element, job->buffer, job->threads, job->lowres, job->scratch, job->dest, &job->qwi_error);
+	qwi_stats_end (job->stats, QWI_STAGE_DECODE, job->index, begin);
+
+  // give back the input buffer
+	qwi_input_release(job->input, job->buffer);
+	job->buffer = NULL;
+
+	g_mutex_lock (&decode_mutex);
+	job->done = TRUE;
+	g_cond_broadcast (&decode_cond);
+	g_mutex_unlock (&decode_mutex);
+}
+
+#define PROGRESSIVE_MIN_PIXELS  (2 << 20)   /* smaller images decode fast enough in one go */
+
+/* Shows the lower resolution levels of an element, coarsest first, before
+ * the full decode. The preview image is resized to each level, and its one
+ * layer updated in place, so GIMP never resamples anything: all the levels
+ * together cost about a third of the full decode. The image being loaded
+ * can't be shown itself (GIMP gives it a display of its own once the load
+ * returns), hence a separate one. The decoder gets a fresh copy of the
+ * bitstream for each level, as it may write to its input. Returns the
+ * display, to be deleted (with its image) once the real image is complete,
+ * or -1.
+ */
+static gint32
+progressive_preview (const QWIIndexEntry *entry,
+		QWIInput            *input,
+		QWIPool             *scratch,
+		const gchar         *filename,
+		guint32              image_width,
+		guint32              image_height)
+{
+	QWI_ELEMENT    element = entry->element;
+	GimpImageType  type;
+	guchar        *bitstream;
+	gint32         image_ID = -1;
+	gint32         display = -1;
+	gint32         layer = -1;
+	gint           lowres;
+
+	switch (element.planes)
+	{
+	case 4:
+		type = GIMP_RGBA_IMAGE;
+		break;
+	case 3:
+		type = GIMP_RGB_IMAGE;
+		break;
+	case 2:
+		type = GIMP_GRAYA_IMAGE;
+		break;
+	case 1:
+		type = GIMP_GRAY_IMAGE;
+		break;
+	default:
+		return -1;
+	}
+
+	bitstream = qwi_input_read_at (input, entry->offset, element.size);
+	if (!bitstream)
+		return -1;
+
+	for (lowres = element.toplayer; lowres > 0; lowres--) {
+		QWI_ELEMENT   level = element;
+		guint32       width = CEIL_RSHIFT(element.width, lowres);
+		guint32       height = CEIL_RSHIFT(element.height, lowres);
+		guchar       *dest = qwi_pool_alloc (scratch, (gsize) width * height * element.planes);
+		guchar       *copy = qwi_pool_alloc (scratch, element.size);
+		guint32       qwi_error = 0;
+		gint64        begin = qwi_trace_begin ();
+		GimpDrawable *drawable;
+		GimpPixelRgn  pixel_rgn;
+
+		if (dest && copy) {
+			memcpy (copy, bitstream, element.size);
+			qwi_core_decode (&level, copy, qwi_threads, lowres, scratch, dest, &qwi_error);
+		}
+		qwi_pool_release (scratch, copy);
+		if (!dest || qwi_error) {
+			qwi_pool_release (scratch, dest);
+			break;
+		}
+
+		// the image and its layer grow to the level, their old pixels are all overwritten
+		if (image_ID == -1) {
+			image_ID = gimp_image_new (CEIL_RSHIFT(image_width, lowres), CEIL_RSHIFT(image_height, lowres), GIMP_RGB);
+			gimp_image_set_filename (image_ID, filename);
+			gimp_image_undo_disable (image_ID);
+			layer = gimp_layer_new (image_ID, "Preview", width, height, type, 100, GIMP_NORMAL_MODE);
+			gimp_image_insert_layer (image_ID, layer, -1, 0);
+		}
+		else {
+			gimp_image_resize (image_ID, CEIL_RSHIFT(image_width, lowres), CEIL_RSHIFT(image_height, lowres), 0, 0);
+			gimp_layer_resize (layer, width, height, 0, 0);
+		}
+		gimp_layer_set_offsets (layer, element.x >> lowres, element.y >> lowres);
+		drawable = gimp_drawable_get (layer);
+		gimp_pixel_rgn_init (&pixel_rgn, drawable, 0, 0, width, height, TRUE, FALSE);
+		gimp_pixel_rgn_set_rect (&pixel_rgn, dest, 0, 0, width, height);
+		gimp_drawable_flush (drawable);
+		gimp_drawable_update (layer, 0, 0, width, height);
+		gimp_drawable_detach (drawable);
+		qwi_pool_release (scratch, dest);
+
+		if (display == -1)
+			display = gimp_display_new (image_ID);
+		gimp_displays_flush ();
+		qwi_trace_end ("preview", lowres, begin);
+	}
+
+	qwi_input_release (input, bitstream);
+	if (display == -1 && image_ID != -1)
+		gimp_image_delete (image_ID);
+	return display;
+}
 
 gint32
 ReadQWI (const gchar  *name,
-		guint32        thumb,
+		const QWILoadVals *vals,
 		guint16        *image_width,
 		guint16        *image_height,
 		GError      **error)
 {
-	FILE              *fd;
+	QWIInput          *input = NULL;
+	QWIPool           *scratch = NULL;
+	QWIStats          *stats = NULL;
+	gint32             preview_display = -1;
+	gint64             begin;
 	gint32             image_ID = -1;
 	QWI_ELEMENT        element;
 	guchar             lowres = 0;
+	gint               top = -1;
 	gshort              elements;
 	gint32             layer;
 	guint16			   width;
 	guint16			   height;
 	guchar            *buffer = NULL;
-	guchar             plane;
-	gshort            *data[4] = {NULL, NULL, NULL, NULL};
-	guchar            *dest;
 	gint               cur_progress, max_progress;
 	GimpImageBaseType  base_type = GIMP_RGB;
-	GimpImageType      image_type;
-	GimpImageType      layers_type;
 	GimpPixelRgn       pixel_rgn;
+	gpointer           pr;
 	GimpDrawable      *drawable;
+	QWIRect            region;
+	QWIIndex          *index = NULL;
+	QWIDecodeJob      *jobs = NULL;
+	GThreadPool       *pool = NULL;
+	gint               window = 0;
+	gint               job_in;
+	gint               job_out;
 
   guint32 qwi_error = 0;
   guint32 code_length = 0;
   gchar *code = NULL;
-#if !defined(WIN32) && !defined(__MINGW32__)
-	struct timespec now, tmstart;
-	double seconds;
-	clock_gettime(CLOCK_REALTIME, &tmstart);
-#endif
+	gint64             load_begin = qwi_trace_begin ();
 	memset(&element, 0, sizeof(QWI_ELEMENT));
 	gimp_progress_init_printf ("Opening '%s'",
 			gimp_filename_to_utf8 (name));
 
 	filename = name;
-	fd = g_fopen (filename, "rb");
+	stats = qwi_stats_new ("load", filename);
+	scratch = qwi_pool_new ();
+	begin = qwi_stats_begin (stats);
+	input = qwi_input_open (filename, scratch, error);
 
-	if (!fd)
-	{
-		g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
-				"Could not open '%s' for reading: %s",
-				gimp_filename_to_utf8 (filename), g_strerror (errno));
+	if (!input)
 		goto out;
-	}
 
-	/* Read the QWI file header */
-	buffer = g_malloc (QWI_FILE_HEADER_SIZE);
-	if (!ReadOK (fd, buffer, QWI_FILE_HEADER_SIZE))
-	{
-		g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
-				"Error reading QWI file '%s'",
-				gimp_filename_to_utf8 (filename));
-		goto out;
-	}
-	if (!qwi_getFileHeader(&element, buffer, &qwi_error)) {
-		g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
-				"file '%s' seems not to be a QWI image",
-				gimp_filename_to_utf8 (filename));
+	/* Read the QWI file header, and the File Optional sections */
+	if (!qwi_core_read_header (input, filename, &element, &code, &code_length, &qwi_error, error))
 		goto out;
-	}
-	g_free(buffer);
-	buffer = NULL;
+	qwi_stats_end (stats, QWI_STAGE_HEADER, -1, begin);
+	qwi_stats_add_bytes (stats, QWI_FILE_HEADER_SIZE + element.file.optionals, 0);
 
 	if (qwi_error) {
 		g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
@@ -129,96 +311,6 @@ ReadQWI (const gchar  *name,
         (QWI_FORMAT>>16)&0xff, (QWI_FORMAT>>8)&0xff);
 	}
 
-	if (element.file.optionals) {
-    guint32 code_offset = 0;
-    guint32 offset;
-    guchar *tmpcode;
-		buffer = g_malloc(element.file.optionals);
-		if (!ReadOK (fd, buffer, element.file.optionals))
-		{
-			g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
-					"Error reading QWI file '%s'",
-					gimp_filename_to_utf8 (filename));
-			goto out;
-		}
-	/* manage File Optional sections here */
-    // first calculate the length of the sections we are interested in ("PAG", "FNT" & "COD")
-    offset = 0;
-    while (offset < (element.file.optionals-3)) {
-      guint32 opt_length;
-      guint32 opt_size;
-      offset = qwi_findOptionalSection(&element, "PAG", 0, offset, buffer, &opt_size, &opt_length) + opt_size;
-      if (!opt_length)
-        offset = element.file.optionals;
-      else
-        code_length += opt_length + 13;
-    }
-    offset = 0;
-    while (offset < (element.file.optionals-3)) {
-      guint32 opt_length;
-      guint32 opt_size;
-      offset = qwi_findOptionalSection(&element, "FNT", 0, offset, buffer, &opt_size, &opt_length) + opt_size;
-      if (!opt_length)
-        offset = element.file.optionals;
-      else
-        code_length += opt_length + 13;
-    }
-    offset = 0;
-    while (offset < (element.file.optionals-3)) {
-      guint32 opt_length;
-      guint32 opt_size;
-      offset = qwi_findOptionalSection(&element, "COD", 0, offset, buffer, &opt_size, &opt_length) + opt_size;
-      if (!opt_length)
-        offset = element.file.optionals;
-      else
-        code_length += opt_length + 13;
-    }
-      // now, get the code and copy it in the global code string
-    if (code_length) {
-      code = g_malloc(code_length+1); // let's set a nul terminated string
-      *(code+code_length) = 0;
-      offset = 0;
-      while (offset < (element.file.optionals-3)) {
-        guint32 tmplength;
-        if (!strncmp((gchar *)(buffer+offset+1), "PAG", 3) || !strncmp((gchar *)(buffer+offset+1), "FNT", 3) || !strncmp((gchar *)(buffer+offset+1), "COD", 3))
-          switch(buffer[offset+1]) {
-            case 'P':
-              strncpy(code+code_offset,"<page>", 6);
-              code_offset += 6;
-              offset += qwi_getOptionalSection(&element, 0, buffer+offset, &tmpcode, &tmplength, &qwi_error);
-              memcpy(code+code_offset, tmpcode, tmplength);
-              free(tmpcode);
-              code_offset += tmplength;
-              strncpy(code+code_offset,"</page>", 7);
-              code_offset += 7;
-              break;
-            case 'F':
-              strncpy(code+code_offset,"<font>", 6);
-              code_offset += 6;
-              offset += qwi_getOptionalSection(&element, 0, buffer+offset, &tmpcode, &tmplength, &qwi_error);
-              memcpy(code+code_offset, tmpcode, tmplength);
-              free(tmpcode);
-              code_offset += tmplength;
-              strncpy(code+code_offset,"</font>", 7);
-              code_offset += 7;
-              break;
-            case 'C':
-              strncpy(code+code_offset,"<code>", 6);
-              code_offset += 6;
-              offset += qwi_getOptionalSection(&element, 0, buffer+offset, &tmpcode, &tmplength, &qwi_error);
-              memcpy(code+code_offset, tmpcode, tmplength);
-              free(tmpcode);
-              code_offset += tmplength;
-              strncpy(code+code_offset,"</code>", 7);
-              code_offset += 7;
-              break;
-          }
-        }
-    }
-		g_free(buffer);
-		buffer = NULL;
-	}
-
 	cur_progress = 0;
 	max_progress = element.file.elements;
 
@@ -239,10 +331,48 @@ ReadQWI (const gchar  *name,
 		*image_width = element.file.width;
 	if (image_height)
 		*image_height = element.file.height;
-	while (thumb && lowres < element.toplayer && (CEIL_RSHIFT(element.file.width, lowres) > thumb || CEIL_RSHIFT(element.file.height, lowres) > thumb))
-		lowres++;
-	width = CEIL_RSHIFT(element.file.width, lowres);
-	height = CEIL_RSHIFT(element.file.height, lowres);
+
+	// the region of interest, clipped to the image (the whole image when there is none)
+	region.x = region.y = 0;
+	region.width = element.file.width;
+	region.height = element.file.height;
+	if (vals->region_width > 0 && vals->region_height > 0) {
+		region.x = CLAMP (vals->region_x, 0, element.file.width);
+		region.y = CLAMP (vals->region_y, 0, element.file.height);
+		region.width = CLAMP (vals->region_x + vals->region_width, 0, element.file.width) - region.x;
+		region.height = CLAMP (vals->region_y + vals->region_height, 0, element.file.height) - region.y;
+		if (region.width <= 0 || region.height <= 0) {
+			g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+					"Region %dx%d+%d+%d is outside of '%s' (%dx%d)",
+					vals->region_width, vals->region_height, vals->region_x, vals->region_y,
+					gimp_filename_to_utf8 (filename), element.file.width, element.file.height);
+			goto out;
+		}
+	}
+
+	// walk the element headers first, seeking past the bitstreams (a thumbnail only needs the first one)
+	begin = qwi_stats_begin (stats);
+	index = qwi_index_scan (input, &element, vals->thumbnail ? 1 : 0, error);
+	qwi_stats_end (stats, QWI_STAGE_INDEX, -1, begin);
+	if (!index) {
+		g_prefix_error (error, "'%s': ", gimp_filename_to_utf8 (filename));
+		goto out;
+	}
+
+	// all the layers share one scale, so no more levels are dropped than the poorest element has
+	for (job_in = 0; job_in < (gint) index->n_entries; job_in++)
+		if (index->entries[job_in].element.width && (top < 0 || index->entries[job_in].element.toplayer < top))
+			top = index->entries[job_in].element.toplayer;
+	top = MAX (top, 0);
+
+	// decode from the lower resolution levels only: for thumbnails and scaled loads
+	if (vals->level >= 0)
+		lowres = MIN (vals->level, top);
+	else
+		while (vals->max_size && lowres < top && (CEIL_RSHIFT(region.width, lowres) > vals->max_size || CEIL_RSHIFT(region.height, lowres) > vals->max_size))
+			lowres++;
+	width = CEIL_RSHIFT(region.width, lowres);
+	height = CEIL_RSHIFT(region.height, lowres);
 	image_ID = gimp_image_new (width, height, base_type);
 	gimp_image_set_filename (image_ID, filename);
 
@@ -251,200 +381,218 @@ ReadQWI (const gchar  *name,
       gimp_parasite_free (code_parasite);
 
     code_parasite = gimp_parasite_new ("code", GIMP_PARASITE_PERSISTENT, code_length + 1, code);
-    g_free(code);
     gimp_image_attach_parasite (image_ID, code_parasite);
 
     gimp_parasite_free (code_parasite);
     code_parasite = NULL;
   }
+  g_free (code);
+  code = NULL;
 
   // Let's process each element in the file (in case of a thumbnail request, just do it for the first element)
-	for (elements = 0; elements < element.file.elements && (!elements || !thumb); elements++)
+  // Bitstreams are read ahead on this thread and decoded on a pool of workers, while the
+  // layers are still created here (libgimp is not thread safe), in the file order.
+
+	// interactive opens of large single element files show the lower levels first
+	if (vals->progressive && index->n_entries == 1 && !lowres && !vals->region_width
+			&& index->entries[0].element.toplayer > 0
+			&& (gsize) index->entries[0].element.width * index->entries[0].element.height >= PROGRESSIVE_MIN_PIXELS)
+		preview_display = progressive_preview (&index->entries[0], input, scratch, filename, width, height);
+
+	window = MAX (1, MIN (qwi_threads, (gint) index->n_entries));
+	qwi_stats_set_threads (stats, qwi_threads);
+	jobs = g_new0 (QWIDecodeJob, window);
+	if (window > 1)
+		pool = g_thread_pool_new (decode_job, NULL, window, FALSE, NULL);
+
+	elements = 0;
+	for (job_in = job_out = 0; ; )
 	{
-		gchar *layername;
-    // get element header
-		buffer = g_malloc (element.file.split && element.file.base ? QWI_ELEMENT_SHORT_HEADER_SIZE : QWI_ELEMENT_HEADER_SIZE);
-		if (!ReadOK (fd, buffer, element.file.split && element.file.base ? QWI_ELEMENT_SHORT_HEADER_SIZE : QWI_ELEMENT_HEADER_SIZE))
-		{
-			g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
-					"Error reading QWI file '%s'",
-					gimp_filename_to_utf8 (filename));
-			goto out;
-		}
-		if (!qwi_getElementHeader(&element, buffer)) {
-			g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
-					"file '%s' seems corrupted or is incompatible with current software",
-					gimp_filename_to_utf8 (filename));
-			goto out;
-		}
-		g_free(buffer);
-		buffer = NULL;
+		QWIDecodeJob *job;
+
+		if (elements < index->n_entries && job_in - job_out < window) {
+			QWIIndexEntry *entry = &index->entries[elements];
+			gchar *layername;
+
+			// empty elements, and elements outside of the region of interest, are not even read
+			element = entry->element;
+			job = &jobs[job_in % window];
+			job->lowres = lowres;
+			if (!element.width || !get_crop (&element, &region, job->lowres, lowres, &job->crop)) {
+				elements++;
+				continue;
+			}
 
-    // get the element bitstream
-		buffer = g_malloc (element.size);
-		if (!ReadOK (fd, buffer, element.size))
-		{
-			g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
-					"Error reading QWI file '%s'",
-					gimp_filename_to_utf8 (filename));
-			goto out;
-		}
-		if (!element.width) {
-			g_free(buffer);
+      // get the element bitstream (straight from the file mapping when there is one)
+			begin = qwi_stats_begin (stats);
+			buffer = qwi_input_read_at (input, entry->offset, element.size);
+			qwi_stats_end (stats, QWI_STAGE_READ, elements, begin);
+			qwi_stats_add_bytes (stats, element.size, 0);
+			if (!buffer)
+			{
+				g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+						"Error reading QWI file '%s'",
+						gimp_filename_to_utf8 (filename));
+				gimp_image_delete (image_ID);
+				image_ID = -1;
+				goto out;
+			}
+			switch (element.planes)
+			{
+			case 4 :
+				job->type = GIMP_RGBA_IMAGE;
+				break;
+			case 3:
+				job->type = GIMP_RGB_IMAGE;
+				break;
+			case 2:
+				job->type = GIMP_GRAYA_IMAGE;
+				break;
+			case 1:
+				job->type = GIMP_GRAY_IMAGE;
+				break;
+
+			default:
+				g_message ("Error while computing QWI file");
+				gimp_image_delete (image_ID);
+				image_ID = -1;
+				goto out;
+			}
+
+			// get layer name (the scan already looked for it when the file is mapped)
+			layername = entry->name;
+			entry->name = NULL;
+			if (!layername)
+				layername = qwi_core_layer_name (&element, input->mapped ? NULL : buffer, elements, name);
+
+			// hand the element over to a decoder
+			job->element = element;
+			job->index = elements;
+			job->threads = MAX (1, qwi_threads / window);
+			job->input = input;
+			job->scratch = scratch;
+			job->stats = stats;
+			job->buffer = buffer;
+			job->layername = layername;
+			job->done = FALSE;
 			buffer = NULL;
+			elements++;
+			job_in++;
+			if (pool)
+				g_thread_pool_push (pool, job, NULL);
+			else
+				decode_job (job, NULL);
 			continue;
 		}
-		switch (element.planes)
-		{
-		case 4 :
-			image_type = GIMP_RGBA_IMAGE;
-			layers_type = GIMP_RGBA_IMAGE;
-			break;
-		case 3:
-			image_type = GIMP_RGB_IMAGE;
-			layers_type = GIMP_RGB_IMAGE;
-			break;
-		case 2:
-			image_type = GIMP_GRAYA_IMAGE;
-			layers_type = GIMP_GRAYA_IMAGE;
-			break;
-		case 1:
-			image_type = GIMP_GRAY_IMAGE;
-			layers_type = GIMP_GRAY_IMAGE;
+
+		if (job_out == job_in)
 			break;
 
-		default:
-			g_message ("Error while computing QWI file");
+		// wait for the oldest element
+		job = &jobs[job_out % window];
+		g_mutex_lock (&decode_mutex);
+		while (!job->done)
+			g_cond_wait (&decode_cond, &decode_mutex);
+		g_mutex_unlock (&decode_mutex);
+
+		if (job->qwi_error) {
+			g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (job->qwi_error),
+					"Error while trying to allocate memory when processing %s",
+					gimp_filename_to_utf8 (filename));
+			gimp_image_delete (image_ID);
 			image_ID = -1;
 			goto out;
 		}
 
-		width = element.width;
-		height = element.height;
-
-		// get layer name
-		if (elements) {
-			guint namesize, namelength;
-			guint nameoffset = qwi_findOptionalSection(&element, "NAM", 1, 0, buffer, &namesize, &namelength);
-			if (namelength)
-        qwi_getOptionalSection(&element, 1, buffer+nameoffset, (guchar**)(&layername), &namelength, &qwi_error);
-      else {
-        layername = malloc(128);
-			  switch (element.file.type)
-			  {
-			  case QWI_TYPE_MULTILAYER:
-				  sprintf(layername, "Layer %d", elements);
-				  break;
-			  case QWI_TYPE_ANIMATE:
-				  sprintf(layername, "Video frame %d (%dms)%s", elements, get_duration(element.duration), element.duration&0x8000?" (combine)":"");
-				  break;
-			  case QWI_TYPE_SLIDESHOW:
-				  sprintf(layername, "Image %d", elements);
-				  break;
-			  default:
-				  sprintf(layername, "%s", name);
-			  }
-			}
-
-			layer = gimp_layer_new (image_ID, layername, width, height,
-					layers_type, 100, GIMP_NORMAL_MODE);
-      free (layername);
-		}
-		else {
-			guint namesize, namelength;
-			guint nameoffset = qwi_findOptionalSection(&element, "NAM", 1, 0, buffer, &namesize, &namelength);
-			if (namelength)
-        qwi_getOptionalSection(&element, 1, buffer+nameoffset, (guchar**)(&layername), &namelength, &qwi_error);
-      else {
-        layername = malloc(128);
-			  if (element.file.type == QWI_TYPE_ANIMATE)
-				  sprintf(layername, "Video frame %d (%dms)%s", elements, get_duration(element.duration), element.duration&0x8000?" (combine)":"");
-			  else if (element.file.type == QWI_TYPE_MULTILAYER)
-				  sprintf(layername, "Background");
-			  else
-				  sprintf(layername, "Image %d", elements);
-      }
-			layer = gimp_layer_new (image_ID, layername, width, height,
-					image_type, 100, GIMP_NORMAL_MODE);
-      free(layername);
-		}
+		// the layer only holds the part of the element inside the region of interest
+		width = job->crop.width;
+		height = job->crop.height;
+		layer = gimp_layer_new (image_ID, job->layername, width, height,
+				job->type, 100, GIMP_NORMAL_MODE);
+		free (job->layername);
+		job->layername = NULL;
 
 		gimp_image_insert_layer (image_ID, layer, -1, 0);
-		gimp_layer_translate (layer, (gint) element.x, (gint) element.y);
+		gimp_layer_translate (layer, job->crop.layer_x, job->crop.layer_y);
 		drawable = gimp_drawable_get (layer);
 		drawable->width = width;
 		drawable->height = height;
 
-    // allocate 128bit aligned memory for the decoding process
-		for (plane = 0; plane < element.planes; plane++)
-#if defined(WIN32) || defined(__MINGW32__)
-			data[plane] = _aligned_malloc (width * height * sizeof (gshort), 16);
-#else
-			data[plane] = aligned_alloc (16, width * height * sizeof (gshort));
-#endif      
-
-    // allocate memory for the output
-		dest      = g_malloc (width * height * element.planes);
-
-		// decode 
-		qwi_decode_mt(&element, 1, 0, element.toplayer-lowres, buffer, data, (void*) dest, &qwi_error);
-		if (qwi_error) {
-			g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (qwi_error),
-					"Error while trying to allocate memory when processing %s",
-					gimp_filename_to_utf8 (filename));
-			return GIMP_PDB_EXECUTION_ERROR;
-		}
-
-    // free up the processing memory and the input buffer
-		for (plane = 0; plane < element.planes; plane++){
-#if defined(WIN32) || defined(__MINGW32__)
-			_aligned_free(data[plane]);
-#else
-			free(data[plane]);
-#endif
-			data[plane] = NULL;
-		}
-		g_free(buffer);
-		buffer = NULL;
 		cur_progress++;
 		gimp_progress_update (((gdouble)cur_progress)/max_progress);
 
-    // copy the output into a a new layer
+    // copy the output into a a new layer, one tile at a time
+		begin = qwi_stats_begin (stats);
+		gimp_tile_cache_ntiles (2 * (width / gimp_tile_width () + 1));
 		gimp_pixel_rgn_init (&pixel_rgn, drawable, 0, 0,
 				width, height, TRUE, FALSE);
-		gimp_pixel_rgn_set_rect (&pixel_rgn, dest,
-				0, 0, width, height);
+		for (pr = gimp_pixel_rgns_register (1, &pixel_rgn); pr != NULL; pr = gimp_pixel_rgns_process (pr))
+		{
+			// the decoder output is at the decoded resolution of the whole element
+			gint row;
+			gsize stride = CEIL_RSHIFT(job->element.width, job->lowres) * job->element.planes;
+			guchar *dst = pixel_rgn.data;
+			const guchar *src = job->dest + (gsize) (pixel_rgn.y + job->crop.y) * stride
+					+ (gsize) (pixel_rgn.x + job->crop.x) * job->element.planes;
+			for (row = 0; row < pixel_rgn.h; row++, dst += pixel_rgn.rowstride, src += stride)
+				memcpy (dst, src, pixel_rgn.w * job->element.planes);
+		}
+		qwi_stats_end (stats, QWI_STAGE_TRANSFER, job->index, begin);
 
+		begin = qwi_stats_begin (stats);
 		gimp_drawable_flush (drawable);
 		gimp_drawable_detach (drawable);
+		qwi_stats_end (stats, QWI_STAGE_FLUSH, job->index, begin);
 
     // free up the decoded output memory
-		g_free (dest);
-		if (thumb)
-			break;
-
+		qwi_pool_release (scratch, job->dest);
+		job->dest = NULL;
+		job_out++;
 	};
 
 	gimp_progress_update (1.0);
 
 	out:
-	if (fd)
-		fclose (fd);
-	if (buffer)
-		g_free(buffer);
-	if (data[0])
-		g_free(data[0]);
-	if (data[1])
-		g_free(data[1]);
-	if (data[2])
-		g_free(data[2]);
-	if (data[3])
-		g_free(data[3]);
-#if !defined(WIN32) && !defined(__MINGW32__)
+	if (pool)
+		g_thread_pool_free (pool, FALSE, TRUE);
+	if (preview_display != -1)
+		gimp_display_delete (preview_display);
+	if (jobs) {
+		for (job_in = 0; job_in < window; job_in++) {
+			if (jobs[job_in].buffer)
+				qwi_input_release (input, jobs[job_in].buffer);
+			qwi_pool_release (scratch, jobs[job_in].dest);
+			free (jobs[job_in].layername);
+		}
+		g_free (jobs);
+	}
+	g_free (code);
+	if (index)
+		qwi_index_free (index);
+	if (input) {
+		if (buffer)
+			qwi_input_release (input, buffer);
+		qwi_input_close (input);
+	}
+	if (scratch) {
+		QWIPoolStats pool_stats;
 
-	clock_gettime(CLOCK_REALTIME, &now);
-	seconds = (double)((now.tv_sec+now.tv_nsec*1e-9) - (double)(tmstart.tv_sec+tmstart.tv_nsec*1e-9));
-	printf("QWI file decoded in %fs\n", seconds);
-#endif
+		qwi_pool_get_stats (scratch, &pool_stats);
+		qwi_stats_add_alloc (stats, pool_stats.requests - pool_stats.reused, pool_stats.allocated_bytes);
+		qwi_stats_set_pool (stats, pool_stats.requests, pool_stats.reused, pool_stats.minor_faults, pool_stats.major_faults);
+		qwi_pool_free (scratch);
+	}
+	if (stats) {
+		// the measure goes along with the image, for the session only
+		gchar *line = qwi_stats_finish (stats);
+
+		if (image_ID != -1) {
+			GimpParasite *parasite = gimp_parasite_new ("qwi-stats", 0, strlen (line) + 1, line);
+			gimp_image_attach_parasite (image_ID, parasite);
+			gimp_parasite_free (parasite);
+		}
+		g_free (line);
+	}
+	qwi_trace_end ("load", -1, load_begin);
 	return image_ID;
 }
@@ -0,0 +1,417 @@
+/* qwi-simd.c   Pixel kernels shared by the QWI reader and writer.  */
+
+/*
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <glib.h>
+
+#include "qwi-simd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define QWI_SIMD_X86
+#include <immintrin.h>
+#define QWI_TARGET(isa) __attribute__((target(isa)))
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define QWI_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+typedef void (*QWIDeinterleaveFunc) (const guchar *src, gshort **dst, guint32 n);
+typedef gboolean (*QWIAlphaSpanFunc) (const guchar *src, guint planes, guint32 n, guint32 *first, guint32 *end);
+
+static QWIDeinterleaveFunc  deinterleave_funcs[5];
+static QWIAlphaSpanFunc     alpha_span_func;
+static const gchar         *simd_name = "c";
+
+// plain C, also used for the remainder of the vector loops
+static inline void
+deinterleave_tail (const guchar  *src,
+		guint          planes,
+		gshort       **dst,
+		guint32        i,
+		guint32        n)
+{
+	guint plane;
+
+	for (src += i * planes; i < n; i++)
+		for (plane = 0; plane < planes; plane++)
+			dst[plane][i] = *src++;
+}
+
+static void deinterleave1_c (const guchar *src, gshort **dst, guint32 n) { deinterleave_tail (src, 1, dst, 0, n); }
+static void deinterleave2_c (const guchar *src, gshort **dst, guint32 n) { deinterleave_tail (src, 2, dst, 0, n); }
+static void deinterleave3_c (const guchar *src, gshort **dst, guint32 n) { deinterleave_tail (src, 3, dst, 0, n); }
+static void deinterleave4_c (const guchar *src, gshort **dst, guint32 n) { deinterleave_tail (src, 4, dst, 0, n); }
+
+static gboolean
+alpha_span_c (const guchar  *src,
+		guint          planes,
+		guint32        n,
+		guint32       *first,
+		guint32       *end)
+{
+	const guchar *alpha = src + planes - 1;
+	guint32 i;
+	guint32 j;
+
+	for (i = 0; i < n && !alpha[i * planes]; i++)
+		;
+	if (i == n)
+		return FALSE;
+	for (j = n; !alpha[(j - 1) * planes]; j--)
+		;
+	*first = i;
+	*end = j;
+	return TRUE;
+}
+
+#ifdef QWI_SIMD_X86
+
+QWI_TARGET("sse2") static void
+deinterleave1_sse2 (const guchar *src, gshort **dst, guint32 n)
+{
+	const __m128i zero = _mm_setzero_si128 ();
+	guint32 i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m128i a = _mm_loadu_si128 ((const __m128i *) (src + i));
+		_mm_storeu_si128 ((__m128i *) (dst[0] + i), _mm_unpacklo_epi8 (a, zero));
+		_mm_storeu_si128 ((__m128i *) (dst[0] + i + 8), _mm_unpackhi_epi8 (a, zero));
+	}
+	deinterleave_tail (src, 1, dst, i, n);
+}
+
+QWI_TARGET("sse2") static void
+deinterleave2_sse2 (const guchar *src, gshort **dst, guint32 n)
+{
+	const __m128i mask = _mm_set1_epi16 (0xff);
+	guint32 i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m128i a = _mm_loadu_si128 ((const __m128i *) (src + 2 * i));
+		_mm_storeu_si128 ((__m128i *) (dst[0] + i), _mm_and_si128 (a, mask));
+		_mm_storeu_si128 ((__m128i *) (dst[1] + i), _mm_srli_epi16 (a, 8));
+	}
+	deinterleave_tail (src, 2, dst, i, n);
+}
+
+// a and b hold 4 pixels each as 32 bit words (one byte per plane)
+#define SPLIT4_SSE2(a, b, planes) \
+	do { \
+		const __m128i mask = _mm_set1_epi32 (0xff); \
+		_mm_storeu_si128 ((__m128i *) (dst[0] + i), \
+				_mm_packs_epi32 (_mm_and_si128 (a, mask), _mm_and_si128 (b, mask))); \
+		_mm_storeu_si128 ((__m128i *) (dst[1] + i), \
+				_mm_packs_epi32 (_mm_and_si128 (_mm_srli_epi32 (a, 8), mask), \
+						_mm_and_si128 (_mm_srli_epi32 (b, 8), mask))); \
+		_mm_storeu_si128 ((__m128i *) (dst[2] + i), \
+				_mm_packs_epi32 (_mm_and_si128 (_mm_srli_epi32 (a, 16), mask), \
+						_mm_and_si128 (_mm_srli_epi32 (b, 16), mask))); \
+		if (planes == 4) \
+			_mm_storeu_si128 ((__m128i *) (dst[3] + i), \
+					_mm_packs_epi32 (_mm_srli_epi32 (a, 24), _mm_srli_epi32 (b, 24))); \
+	} while (0)
+
+QWI_TARGET("sse2") static void
+deinterleave4_sse2 (const guchar *src, gshort **dst, guint32 n)
+{
+	guint32 i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m128i a = _mm_loadu_si128 ((const __m128i *) (src + 4 * i));
+		__m128i b = _mm_loadu_si128 ((const __m128i *) (src + 4 * i + 16));
+		SPLIT4_SSE2 (a, b, 4);
+	}
+	deinterleave_tail (src, 4, dst, i, n);
+}
+
+// the bytes other than alpha are masked out, a set bit in the result is a byte that is not 0
+#define ALPHA_BITS_SSE2(p) \
+	(~_mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_and_si128 (_mm_loadu_si128 ((const __m128i *) (p)), mask), zero)) & 0xffff)
+
+QWI_TARGET("sse2") static gboolean
+alpha_span_sse2 (const guchar *src, guint planes, guint32 n, guint32 *first, guint32 *end)
+{
+	const __m128i mask = planes == 4 ? _mm_set1_epi32 ((gint) 0xff000000) : _mm_set1_epi16 ((gshort) 0xff00);
+	const __m128i zero = _mm_setzero_si128 ();
+	const guint32 step = 16 / planes;
+	guint32 i;
+	guint32 j;
+	gint    bits = 0;
+
+	for (i = 0; i + step <= n; i += step)
+		if ((bits = ALPHA_BITS_SSE2 (src + i * planes)) != 0)
+			break;
+	if (bits)
+		i += __builtin_ctz (bits) / planes;
+	else {
+		for (; i < n && !src[i * planes + planes - 1]; i++)
+			;
+		if (i == n)
+			return FALSE;
+	}
+	*first = i;
+
+	// there is a pixel to find at *first, so this stops there at the latest
+	for (j = n; j >= step; j -= step)
+		if ((bits = ALPHA_BITS_SSE2 (src + (j - step) * planes)) != 0)
+			break;
+	if (bits)
+		j = j - step + (31 - __builtin_clz (bits)) / planes + 1;
+	else
+		for (; !src[(j - 1) * planes + planes - 1]; j--)
+			;
+	*end = j;
+	return TRUE;
+}
+
+// SSE2 has no byte shuffle, RGB needs SSSE3 to spread pixels to 32 bit words
+QWI_TARGET("ssse3") static void
+deinterleave3_ssse3 (const guchar *src, gshort **dst, guint32 n)
+{
+	const __m128i spread = _mm_setr_epi8 (0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	guint32 i;
+
+	// the second load reads 4 bytes past the 8 pixels
+	for (i = 0; i + 10 <= n; i += 8) {
+		__m128i a = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (src + 3 * i)), spread);
+		__m128i b = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (src + 3 * i + 12)), spread);
+		SPLIT4_SSE2 (a, b, 3);
+	}
+	deinterleave_tail (src, 3, dst, i, n);
+}
+
+QWI_TARGET("avx2") static void
+deinterleave1_avx2 (const guchar *src, gshort **dst, guint32 n)
+{
+	guint32 i;
+
+	for (i = 0; i + 16 <= n; i += 16)
+		_mm256_storeu_si256 ((__m256i *) (dst[0] + i),
+				_mm256_cvtepu8_epi16 (_mm_loadu_si128 ((const __m128i *) (src + i))));
+	deinterleave_tail (src, 1, dst, i, n);
+}
+
+QWI_TARGET("avx2") static void
+deinterleave2_avx2 (const guchar *src, gshort **dst, guint32 n)
+{
+	const __m256i mask = _mm256_set1_epi16 (0xff);
+	guint32 i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m256i a = _mm256_loadu_si256 ((const __m256i *) (src + 2 * i));
+		_mm256_storeu_si256 ((__m256i *) (dst[0] + i), _mm256_and_si256 (a, mask));
+		_mm256_storeu_si256 ((__m256i *) (dst[1] + i), _mm256_srli_epi16 (a, 8));
+	}
+	deinterleave_tail (src, 2, dst, i, n);
+}
+
+// a and b hold 8 pixels each as 32 bit words; packs works per 128 bit lane,
+// so the 64 bit quarters are put back in order afterwards
+#define PACK_AVX2(a, b) _mm256_permute4x64_epi64 (_mm256_packs_epi32 (a, b), 0xd8)
+#define SPLIT4_AVX2(a, b, planes) \
+	do { \
+		const __m256i mask = _mm256_set1_epi32 (0xff); \
+		_mm256_storeu_si256 ((__m256i *) (dst[0] + i), \
+				PACK_AVX2 (_mm256_and_si256 (a, mask), _mm256_and_si256 (b, mask))); \
+		_mm256_storeu_si256 ((__m256i *) (dst[1] + i), \
+				PACK_AVX2 (_mm256_and_si256 (_mm256_srli_epi32 (a, 8), mask), \
+						_mm256_and_si256 (_mm256_srli_epi32 (b, 8), mask))); \
+		_mm256_storeu_si256 ((__m256i *) (dst[2] + i), \
+				PACK_AVX2 (_mm256_and_si256 (_mm256_srli_epi32 (a, 16), mask), \
+						_mm256_and_si256 (_mm256_srli_epi32 (b, 16), mask))); \
+		if (planes == 4) \
+			_mm256_storeu_si256 ((__m256i *) (dst[3] + i), \
+					PACK_AVX2 (_mm256_srli_epi32 (a, 24), _mm256_srli_epi32 (b, 24))); \
+	} while (0)
+
+QWI_TARGET("avx2") static void
+deinterleave3_avx2 (const guchar *src, gshort **dst, guint32 n)
+{
+	const __m256i spread = _mm256_setr_epi8 (0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+			0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	guint32 i;
+
+	// the last load reads 4 bytes past the 16 pixels
+	for (i = 0; i + 18 <= n; i += 16) {
+		const guchar *p = src + 3 * i;
+		__m256i a = _mm256_inserti128_si256 (_mm256_castsi128_si256 (_mm_loadu_si128 ((const __m128i *) p)),
+				_mm_loadu_si128 ((const __m128i *) (p + 12)), 1);
+		__m256i b = _mm256_inserti128_si256 (_mm256_castsi128_si256 (_mm_loadu_si128 ((const __m128i *) (p + 24))),
+				_mm_loadu_si128 ((const __m128i *) (p + 36)), 1);
+		a = _mm256_shuffle_epi8 (a, spread);
+		b = _mm256_shuffle_epi8 (b, spread);
+		SPLIT4_AVX2 (a, b, 3);
+	}
+	deinterleave_tail (src, 3, dst, i, n);
+}
+
+QWI_TARGET("avx2") static void
+deinterleave4_avx2 (const guchar *src, gshort **dst, guint32 n)
+{
+	guint32 i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m256i a = _mm256_loadu_si256 ((const __m256i *) (src + 4 * i));
+		__m256i b = _mm256_loadu_si256 ((const __m256i *) (src + 4 * i + 32));
+		SPLIT4_AVX2 (a, b, 4);
+	}
+	deinterleave_tail (src, 4, dst, i, n);
+}
+
+#endif /* QWI_SIMD_X86 */
+
+#ifdef QWI_SIMD_NEON
+
+#define WIDEN_NEON(v, d) \
+	do { \
+		vst1q_s16 ((d) + i, vreinterpretq_s16_u16 (vmovl_u8 (vget_low_u8 (v)))); \
+		vst1q_s16 ((d) + i + 8, vreinterpretq_s16_u16 (vmovl_u8 (vget_high_u8 (v)))); \
+	} while (0)
+
+static void
+deinterleave1_neon (const guchar *src, gshort **dst, guint32 n)
+{
+	guint32 i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		uint8x16_t v = vld1q_u8 (src + i);
+		WIDEN_NEON (v, dst[0]);
+	}
+	deinterleave_tail (src, 1, dst, i, n);
+}
+
+static void
+deinterleave2_neon (const guchar *src, gshort **dst, guint32 n)
+{
+	guint32 i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		uint8x16x2_t v = vld2q_u8 (src + 2 * i);
+		WIDEN_NEON (v.val[0], dst[0]);
+		WIDEN_NEON (v.val[1], dst[1]);
+	}
+	deinterleave_tail (src, 2, dst, i, n);
+}
+
+static void
+deinterleave3_neon (const guchar *src, gshort **dst, guint32 n)
+{
+	guint32 i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		uint8x16x3_t v = vld3q_u8 (src + 3 * i);
+		WIDEN_NEON (v.val[0], dst[0]);
+		WIDEN_NEON (v.val[1], dst[1]);
+		WIDEN_NEON (v.val[2], dst[2]);
+	}
+	deinterleave_tail (src, 3, dst, i, n);
+}
+
+static void
+deinterleave4_neon (const guchar *src, gshort **dst, guint32 n)
+{
+	guint32 i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		uint8x16x4_t v = vld4q_u8 (src + 4 * i);
+		WIDEN_NEON (v.val[0], dst[0]);
+		WIDEN_NEON (v.val[1], dst[1]);
+		WIDEN_NEON (v.val[2], dst[2]);
+		WIDEN_NEON (v.val[3], dst[3]);
+	}
+	deinterleave_tail (src, 4, dst, i, n);
+}
+
+#endif /* QWI_SIMD_NEON */
+
+static void
+simd_init (void)
+{
+	static gsize initialized = 0;
+
+	if (!g_once_init_enter (&initialized))
+		return;
+
+	deinterleave_funcs[1] = deinterleave1_c;
+	deinterleave_funcs[2] = deinterleave2_c;
+	deinterleave_funcs[3] = deinterleave3_c;
+	deinterleave_funcs[4] = deinterleave4_c;
+	alpha_span_func = alpha_span_c;
+
+	if (!g_getenv ("QWI_NO_SIMD")) {
+#ifdef QWI_SIMD_X86
+		__builtin_cpu_init ();
+		if (__builtin_cpu_supports ("sse2")) {
+			deinterleave_funcs[1] = deinterleave1_sse2;
+			deinterleave_funcs[2] = deinterleave2_sse2;
+			deinterleave_funcs[4] = deinterleave4_sse2;
+			alpha_span_func = alpha_span_sse2;
+			simd_name = "sse2";
+		}
+		if (__builtin_cpu_supports ("ssse3")) {
+			deinterleave_funcs[3] = deinterleave3_ssse3;
+			simd_name = "ssse3";
+		}
+		if (__builtin_cpu_supports ("avx2")) {
+			deinterleave_funcs[1] = deinterleave1_avx2;
+			deinterleave_funcs[2] = deinterleave2_avx2;
+			deinterleave_funcs[3] = deinterleave3_avx2;
+			deinterleave_funcs[4] = deinterleave4_avx2;
+			simd_name = "avx2";
+		}
+#elif defined(QWI_SIMD_NEON)
+		deinterleave_funcs[1] = deinterleave1_neon;
+		deinterleave_funcs[2] = deinterleave2_neon;
+		deinterleave_funcs[3] = deinterleave3_neon;
+		deinterleave_funcs[4] = deinterleave4_neon;
+		simd_name = "neon";
+#endif
+	}
+
+	g_once_init_leave (&initialized, 1);
+}
+
+void
+qwi_deinterleave (const guchar  *src,
+		guint          planes,
+		gshort       **dst,
+		guint32        n)
+{
+	simd_init ();
+	deinterleave_funcs[planes] (src, dst, n);
+}
+
+gboolean
+qwi_alpha_span (const guchar  *src,
+		guint          planes,
+		guint32        n,
+		guint32       *first,
+		guint32       *end)
+{
+	simd_init ();
+	return alpha_span_func (src, planes, n, first, end);
+}
+
+const gchar *
+qwi_simd_name (void)
+{
+	simd_init ();
+	return simd_name;
+}
@@ -0,0 +1,44 @@
+/*
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __QWI_SIMD_H__
+#define __QWI_SIMD_H__
+
+/* Splits n interleaved pixels of 1 to 4 bytes into the int16 planes
+ * dst[0] .. dst[planes-1]. The kernel (SSE2, SSSE3, AVX2, NEON or plain C)
+ * is picked once, from the CPU the plug-in runs on.
+ */
+void         qwi_deinterleave      (const guchar  *src,
+                                    guint          planes,
+                                    gshort       **dst,
+                                    guint32        n);
+
+/* Finds the pixels of a row of n interleaved pixels of 2 or 4 bytes whose
+ * alpha (the last byte) is not 0. Returns FALSE when there is none, else
+ * the first one in *first and the one after the last in *end.
+ */
+gboolean     qwi_alpha_span        (const guchar  *src,
+                                    guint          planes,
+                                    guint32        n,
+                                    guint32       *first,
+                                    guint32       *end);
+
+/* Name of the kernel set qwi_deinterleave dispatches to */
+const gchar *qwi_simd_name         (void);
+
+#endif /* __QWI_SIMD_H__ */
@@ -0,0 +1,240 @@
+/* qwi-stats.c  Per stage timings and counters of loads and saves.   */
+
+/*
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "qwi-stats.h"
+#include "qwi-trace.h"
+
+static const gchar *stage_names[QWI_N_STAGES] =
+{
+	"header", "index", "read", "decode", "transfer", "flush", "optionals", "encode", "write"
+};
+
+// the time spent in each stage by one element
+typedef struct
+{
+	gint64 us[QWI_N_STAGES];
+} ElementSpans;
+
+struct _QWIStats
+{
+	GMutex   mutex;
+	gchar   *operation;
+	gchar   *filename;
+	gint64   start;
+	gint64   stage_us[QWI_N_STAGES];
+	guint    stage_count[QWI_N_STAGES];
+	GArray  *elements;
+	guint64  bytes_read;
+	guint64  bytes_written;
+	guint64  alloc_count;
+	guint64  alloc_bytes;
+	gint     threads;
+	guint64  pool_requests;
+	guint64  pool_reused;
+	glong    minor_faults;
+	glong    major_faults;
+};
+
+QWIStats *
+qwi_stats_new (const gchar *operation,
+		const gchar *filename)
+{
+	QWIStats *stats;
+
+	if (!g_getenv ("QWI_STATS"))
+		return NULL;
+
+	stats = g_new0 (QWIStats, 1);
+	g_mutex_init (&stats->mutex);
+	stats->operation = g_strdup (operation);
+	stats->filename = g_strdup (filename);
+	stats->elements = g_array_new (FALSE, TRUE, sizeof (ElementSpans));
+	stats->threads = 1;
+	stats->start = g_get_monotonic_time ();
+	return stats;
+}
+
+gint64
+qwi_stats_begin (QWIStats *stats)
+{
+	return stats || qwi_trace_enabled () ? g_get_monotonic_time () : 0;
+}
+
+void
+qwi_stats_end (QWIStats *stats,
+		QWIStage  stage,
+		gint      element,
+		gint64    begin)
+{
+	gint64 span;
+
+	// stages are traced too, whether they are measured or not
+	qwi_trace_end (stage_names[stage], element, begin);
+	if (!stats)
+		return;
+
+	span = g_get_monotonic_time () - begin;
+	g_mutex_lock (&stats->mutex);
+	stats->stage_us[stage] += span;
+	stats->stage_count[stage]++;
+	if (element >= 0) {
+		if ((guint) element >= stats->elements->len)
+			g_array_set_size (stats->elements, element + 1);
+		g_array_index (stats->elements, ElementSpans, element).us[stage] += span;
+	}
+	g_mutex_unlock (&stats->mutex);
+}
+
+void
+qwi_stats_add_bytes (QWIStats *stats,
+		guint64   read,
+		guint64   written)
+{
+	if (!stats)
+		return;
+
+	g_mutex_lock (&stats->mutex);
+	stats->bytes_read += read;
+	stats->bytes_written += written;
+	g_mutex_unlock (&stats->mutex);
+}
+
+void
+qwi_stats_add_alloc (QWIStats *stats,
+		guint64   count,
+		guint64   bytes)
+{
+	if (!stats)
+		return;
+
+	g_mutex_lock (&stats->mutex);
+	stats->alloc_count += count;
+	stats->alloc_bytes += bytes;
+	g_mutex_unlock (&stats->mutex);
+}
+
+void
+qwi_stats_set_threads (QWIStats *stats,
+		gint      threads)
+{
+	if (stats)
+		stats->threads = threads;
+}
+
+void
+qwi_stats_set_pool (QWIStats *stats,
+		guint64   requests,
+		guint64   reused,
+		glong     minor_faults,
+		glong     major_faults)
+{
+	if (!stats)
+		return;
+
+	stats->pool_requests = requests;
+	stats->pool_reused = reused;
+	stats->minor_faults = minor_faults;
+	stats->major_faults = major_faults;
+}
+
+// file names go in as they are, but for the characters JSON wants escaped
+static void
+append_json_string (GString     *line,
+		const gchar *string)
+{
+	const guchar *p;
+
+	g_string_append_c (line, '"');
+	for (p = (const guchar *) string; *p; p++)
+		if (*p == '"' || *p == '\\')
+			g_string_append_printf (line, "\\%c", *p);
+		else if (*p < 0x20)
+			g_string_append_printf (line, "\\u%04x", *p);
+		else
+			g_string_append_c (line, *p);
+	g_string_append_c (line, '"');
+}
+
+gchar *
+qwi_stats_finish (QWIStats *stats)
+{
+	const gchar *target;
+	GString     *line;
+	guint        stage, i;
+
+	if (!stats)
+		return NULL;
+
+	line = g_string_new (NULL);
+	g_string_append_printf (line, "{\"operation\":\"%s\",\"file\":", stats->operation);
+	append_json_string (line, stats->filename);
+	g_string_append_printf (line, ",\"total_us\":%" G_GINT64_FORMAT
+			",\"threads\":%d,\"bytes_read\":%" G_GUINT64_FORMAT ",\"bytes_written\":%" G_GUINT64_FORMAT
+			",\"alloc_count\":%" G_GUINT64_FORMAT ",\"alloc_bytes\":%" G_GUINT64_FORMAT ",",
+			g_get_monotonic_time () - stats->start, stats->threads,
+			stats->bytes_read, stats->bytes_written, stats->alloc_count, stats->alloc_bytes);
+	if (stats->pool_requests)
+		g_string_append_printf (line, "\"pool\":{\"requests\":%" G_GUINT64_FORMAT ",\"reused\":%" G_GUINT64_FORMAT
+				",\"minor_faults\":%ld,\"major_faults\":%ld},",
+				stats->pool_requests, stats->pool_reused, stats->minor_faults, stats->major_faults);
+	g_string_append (line, "\"stages\":{");
+
+	// only the stages this operation went through
+	for (stage = 0, i = 0; stage < QWI_N_STAGES; stage++)
+		if (stats->stage_count[stage])
+			g_string_append_printf (line, "%s\"%s\":{\"us\":%" G_GINT64_FORMAT ",\"count\":%u}", i++ ? "," : "",
+					stage_names[stage], stats->stage_us[stage], stats->stage_count[stage]);
+	g_string_append (line, "},\"elements\":[");
+	for (i = 0; i < stats->elements->len; i++) {
+		ElementSpans *spans = &g_array_index (stats->elements, ElementSpans, i);
+
+		g_string_append_printf (line, "%s{\"index\":%u", i ? "," : "", i);
+		for (stage = 0; stage < QWI_N_STAGES; stage++)
+			if (spans->us[stage])
+				g_string_append_printf (line, ",\"%s_us\":%" G_GINT64_FORMAT, stage_names[stage], spans->us[stage]);
+		g_string_append_c (line, '}');
+	}
+	g_string_append (line, "]}");
+
+	target = g_getenv ("QWI_STATS");
+	if (!target || !*target || !strcmp (target, "1"))
+		g_printerr ("%s\n", line->str);
+	else {
+		FILE *out = g_fopen (target, "a");
+		if (out) {
+			fprintf (out, "%s\n", line->str);
+			fclose (out);
+		}
+	}
+
+	g_array_free (stats->elements, TRUE);
+	g_free (stats->operation);
+	g_free (stats->filename);
+	g_mutex_clear (&stats->mutex);
+	g_free (stats);
+	return g_string_free (line, FALSE);
+}
@@ -0,0 +1,80 @@
+/*
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __QWI_STATS_H__
+#define __QWI_STATS_H__
+
+/* Per stage timings and counters of a load or a save. Everything is a
+ * no-op on a NULL QWIStats, which is what qwi_stats_new returns unless
+ * QWI_STATS is set: to "1" for a JSON line on stderr, or to a file name
+ * the lines are appended to.
+ */
+
+typedef enum
+{
+  QWI_STAGE_HEADER,      /* file header and file optionals */
+  QWI_STAGE_INDEX,       /* element header scan */
+  QWI_STAGE_READ,        /* bitstream reads */
+  QWI_STAGE_DECODE,      /* qwi_decode_mt */
+  QWI_STAGE_TRANSFER,    /* pixels to or from GIMP tiles */
+  QWI_STAGE_FLUSH,       /* gimp_drawable_flush */
+  QWI_STAGE_OPTIONALS,   /* file optionals, when saving */
+  QWI_STAGE_ENCODE,      /* qwi_encode */
+  QWI_STAGE_WRITE,       /* bitstream writes */
+  QWI_N_STAGES
+} QWIStage;
+
+typedef struct _QWIStats QWIStats;
+
+QWIStats  *qwi_stats_new        (const gchar  *operation,
+                                 const gchar  *filename);
+
+/* A span runs from qwi_stats_begin to qwi_stats_end. element is the
+ * element number, or -1 for a file wide stage. Thread safe. Spans also
+ * go to qwi-trace when QWI_TRACE is set, even without QWI_STATS.
+ */
+gint64     qwi_stats_begin      (QWIStats     *stats);
+void       qwi_stats_end        (QWIStats     *stats,
+                                 QWIStage      stage,
+                                 gint          element,
+                                 gint64        begin);
+
+void       qwi_stats_add_bytes  (QWIStats     *stats,
+                                 guint64       read,
+                                 guint64       written);
+void       qwi_stats_add_alloc  (QWIStats     *stats,
+                                 guint64       count,
+                                 guint64       bytes);
+void       qwi_stats_set_threads (QWIStats    *stats,
+                                 gint          threads);
+
+/* The scratch pool of a load: block requests, how many were served from
+ * its free lists, and the page faults taken while it was alive.
+ */
+void       qwi_stats_set_pool   (QWIStats     *stats,
+                                 guint64       requests,
+                                 guint64       reused,
+                                 glong         minor_faults,
+                                 glong         major_faults);
+
+/* Ends the measure, emits it and frees stats. Returns the JSON line
+ * (g_malloc'd), NULL when stats is.
+ */
+gchar     *qwi_stats_finish     (QWIStats     *stats);
+
+#endif /* __QWI_STATS_H__ */
@@ -0,0 +1,303 @@
+/* qwi-thumbcache.c  Persistent cache of decoded QWI thumbnails.      */
+
+/*
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "qwi-thumbcache.h"
+
+#define THUMBCACHE_MAGIC        "QWIT"
+#define THUMBCACHE_VERSION      1
+#define THUMBCACHE_HEADER_SIZE  24
+#define THUMBCACHE_DEFAULT_MIB  64
+#define THUMBCACHE_USAGE        "usage"
+
+typedef struct
+{
+	gchar   *path;
+	goffset  size;
+	time_t   used;
+} CacheFile;
+
+static gsize
+cache_limit (void)
+{
+	const gchar *env = g_getenv ("QWI_THUMB_CACHE_SIZE");
+	gint64       mib = env ? g_ascii_strtoll (env, NULL, 10) : THUMBCACHE_DEFAULT_MIB;
+
+	// negative sizes turn the cache off, like 0
+	return mib > 0 ? (gsize) MIN (mib, G_MAXSIZE >> 20) << 20 : 0;
+}
+
+// sub-second part of the modification time, where the system keeps one
+static glong
+mtime_nsec (const struct stat *st)
+{
+#if defined(__APPLE__)
+	return st->st_mtimespec.tv_nsec;
+#elif defined(WIN32) || defined(__MINGW32__)
+	return 0;
+#else
+	return st->st_mtim.tv_nsec;
+#endif
+}
+
+// cache file of a (file, thumbnail size) pair, NULL when the file is gone
+static gchar *
+cache_path (const gchar *filename,
+		guint32      size)
+{
+	struct stat  st;
+	gchar       *key;
+	gchar       *sum;
+	gchar       *name;
+	gchar       *path;
+
+	if (g_stat (filename, &st) != 0)
+		return NULL;
+
+	key = g_strdup_printf ("%s\n%lld.%09ld\n%lld\n%u", filename,
+			(long long) st.st_mtime, mtime_nsec (&st), (long long) st.st_size, size);
+	sum = g_compute_checksum_for_string (G_CHECKSUM_SHA1, key, -1);
+	name = g_strconcat (sum, ".qwt", NULL);
+	path = g_build_filename (g_get_user_cache_dir (), "qwi-thumbnails", name, NULL);
+	g_free (name);
+	g_free (sum);
+	g_free (key);
+	return path;
+}
+
+static void
+put16 (guchar  *p,
+		guint16  v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+static guint16
+get16 (const guchar *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+gboolean
+qwi_thumbcache_lookup (const gchar  *filename,
+		guint32       size,
+		QWIThumbnail *thumb)
+{
+	gchar   *path;
+	gchar   *contents = NULL;
+	gsize    length;
+	gsize    pixels;
+	guchar  *p;
+
+	if (!cache_limit () || !(path = cache_path (filename, size)))
+		return FALSE;
+
+	if (!g_file_get_contents (path, &contents, &length, NULL) || length < THUMBCACHE_HEADER_SIZE
+			|| memcmp (contents, THUMBCACHE_MAGIC, 4) || contents[4] != THUMBCACHE_VERSION) {
+		g_free (contents);
+		g_free (path);
+		return FALSE;
+	}
+
+	p = (guchar *) contents;
+	thumb->image_width  = get16 (p + 6);
+	thumb->image_height = get16 (p + 8);
+	thumb->width        = get16 (p + 10);
+	thumb->height       = get16 (p + 12);
+	thumb->layer_width  = get16 (p + 14);
+	thumb->layer_height = get16 (p + 16);
+	thumb->layer_x      = (gint16) get16 (p + 18);
+	thumb->layer_y      = (gint16) get16 (p + 20);
+	thumb->planes       = p[5];
+	pixels = (gsize) thumb->layer_width * thumb->layer_height * thumb->planes;
+	if (thumb->planes < 1 || thumb->planes > 4 || length != THUMBCACHE_HEADER_SIZE + pixels) {
+		g_free (contents);
+		g_free (path);
+		return FALSE;
+	}
+
+	thumb->pixels = g_malloc (MAX (pixels, 1));
+	memcpy (thumb->pixels, p + THUMBCACHE_HEADER_SIZE, pixels);
+	g_free (contents);
+
+	// the modification time of a cache file is its last use, for the eviction
+	g_utime (path, NULL);
+	g_free (path);
+	return TRUE;
+}
+
+static gint
+compare_used (gconstpointer a,
+		gconstpointer b)
+{
+	const CacheFile *fa = *(const CacheFile * const *) a;
+	const CacheFile *fb = *(const CacheFile * const *) b;
+
+	return fa->used < fb->used ? -1 : fa->used > fb->used;
+}
+
+static void
+cache_file_free (gpointer data)
+{
+	CacheFile *file = data;
+
+	g_free (file->path);
+	g_free (file);
+}
+
+/* The bytes in the cache are kept in a file next to the thumbnails, so a
+ * store only has to scan the directory when the limit is reached. -1 when
+ * it is missing; concurrent stores may leave it off, which the next scan
+ * puts right.
+ */
+static goffset
+cache_usage (const gchar *dirname)
+{
+	gchar   *path = g_build_filename (dirname, THUMBCACHE_USAGE, NULL);
+	gchar   *contents = NULL;
+	goffset  usage = -1;
+
+	if (g_file_get_contents (path, &contents, NULL, NULL))
+		usage = g_ascii_strtoll (contents, NULL, 10);
+	g_free (contents);
+	g_free (path);
+	return usage;
+}
+
+static void
+cache_set_usage (const gchar *dirname,
+		goffset      usage)
+{
+	gchar *path = g_build_filename (dirname, THUMBCACHE_USAGE, NULL);
+	gchar *contents = g_strdup_printf ("%" G_GINT64_FORMAT "\n", (gint64) usage);
+
+	g_file_set_contents (path, contents, -1, NULL);
+	g_free (contents);
+	g_free (path);
+}
+
+// drop the least recently used thumbnails until the cache fits in its limit
+static void
+cache_evict (const gchar *dirname,
+		gsize        limit)
+{
+	GDir        *dir;
+	const gchar *name;
+	GPtrArray   *files;
+	goffset      total = 0;
+	guint        i;
+
+	if (!(dir = g_dir_open (dirname, 0, NULL)))
+		return;
+
+	files = g_ptr_array_new_with_free_func (cache_file_free);
+	while ((name = g_dir_read_name (dir)) != NULL) {
+		struct stat  st;
+		gchar       *path;
+
+		if (!g_str_has_suffix (name, ".qwt"))
+			continue;
+		path = g_build_filename (dirname, name, NULL);
+		if (g_stat (path, &st) == 0) {
+			CacheFile *file = g_new (CacheFile, 1);
+			file->path = path;
+			file->size = st.st_size;
+			file->used = st.st_mtime;
+			g_ptr_array_add (files, file);
+			total += st.st_size;
+		}
+		else
+			g_free (path);
+	}
+	g_dir_close (dir);
+
+	if (total > (goffset) limit) {
+		g_ptr_array_sort (files, compare_used);
+		for (i = 0; i < files->len && total > (goffset) limit; i++) {
+			CacheFile *file = g_ptr_array_index (files, i);
+			if (g_unlink (file->path) == 0)
+				total -= file->size;
+		}
+	}
+	g_ptr_array_free (files, TRUE);
+	cache_set_usage (dirname, total);
+}
+
+void
+qwi_thumbcache_store (const gchar        *filename,
+		guint32             size,
+		const QWIThumbnail *thumb)
+{
+	gsize    limit = cache_limit ();
+	gsize    pixels = (gsize) thumb->layer_width * thumb->layer_height * thumb->planes;
+	gchar   *path;
+	gchar   *dirname;
+	guchar  *blob;
+
+	if (!limit || THUMBCACHE_HEADER_SIZE + pixels > limit || !(path = cache_path (filename, size)))
+		return;
+
+	dirname = g_path_get_dirname (path);
+	g_mkdir_with_parents (dirname, 0700);
+
+	blob = g_malloc0 (THUMBCACHE_HEADER_SIZE + pixels);
+	memcpy (blob, THUMBCACHE_MAGIC, 4);
+	blob[4] = THUMBCACHE_VERSION;
+	blob[5] = thumb->planes;
+	put16 (blob + 6, thumb->image_width);
+	put16 (blob + 8, thumb->image_height);
+	put16 (blob + 10, thumb->width);
+	put16 (blob + 12, thumb->height);
+	put16 (blob + 14, thumb->layer_width);
+	put16 (blob + 16, thumb->layer_height);
+	put16 (blob + 18, (guint16) thumb->layer_x);
+	put16 (blob + 20, (guint16) thumb->layer_y);
+	memcpy (blob + THUMBCACHE_HEADER_SIZE, thumb->pixels, pixels);
+
+	// written to a temporary file and renamed: concurrent readers never see half a thumbnail
+	if (g_file_set_contents (path, (const gchar *) blob, THUMBCACHE_HEADER_SIZE + pixels, NULL)) {
+		goffset usage = cache_usage (dirname);
+
+		if (usage < 0 || usage + (goffset) (THUMBCACHE_HEADER_SIZE + pixels) > (goffset) limit)
+			cache_evict (dirname, limit);
+		else
+			cache_set_usage (dirname, usage + (goffset) (THUMBCACHE_HEADER_SIZE + pixels));
+	}
+
+	g_free (blob);
+	g_free (dirname);
+	g_free (path);
+}
+
+void
+qwi_thumbnail_clear (QWIThumbnail *thumb)
+{
+	g_free (thumb->pixels);
+	thumb->pixels = NULL;
+}
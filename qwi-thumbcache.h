@@ -0,0 +1,51 @@
+/*
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __QWI_THUMBCACHE_H__
+#define __QWI_THUMBCACHE_H__
+
+/* A decoded thumbnail: the first element of a file, as a single layer */
+typedef struct
+{
+  guint16  image_width;   /* full size image */
+  guint16  image_height;
+  guint16  width;         /* thumbnail image */
+  guint16  height;
+  guint16  layer_width;
+  guint16  layer_height;
+  gint16   layer_x;
+  gint16   layer_y;
+  guchar   planes;
+  guchar  *pixels;        /* layer_width * layer_height * planes, interleaved */
+} QWIThumbnail;
+
+/* Thumbnails are cached in the user cache directory, keyed on the file
+ * path, modification time (to the nanosecond where the system has it) and
+ * size and on the requested thumbnail size.
+ * The cache is bounded by QWI_THUMB_CACHE_SIZE (MiB, default 64, 0 turns
+ * it off); the least recently used thumbnails are evicted first.
+ */
+gboolean   qwi_thumbcache_lookup  (const gchar        *filename,
+                                   guint32             size,
+                                   QWIThumbnail       *thumb);
+void       qwi_thumbcache_store   (const gchar        *filename,
+                                   guint32             size,
+                                   const QWIThumbnail *thumb);
+void       qwi_thumbnail_clear    (QWIThumbnail       *thumb);
+
+#endif /* __QWI_THUMBCACHE_H__ */
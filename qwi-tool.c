@@ -0,0 +1,359 @@
+/* qwi-tool.c   Batch conversion between QWI and other image files.  */
+
+/*
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+#include "qwi.h"
+#include "qwi-input.h"
+#include "qwi-index.h"
+#include "qwi-core.h"
+
+/* qwi-tool encode|decode|info [options] files...
+ *
+ * encode: any image gdk-pixbuf reads (PNG, JPEG, ...) to .qwi
+ * decode: .qwi to .png (one file per element when there are several)
+ * info:   file header and element table, without decoding
+ *
+ * Files are processed by a pool of -j workers, each file on one worker.
+ */
+
+typedef enum
+{
+	TOOL_ENCODE,
+	TOOL_DECODE,
+	TOOL_INFO
+} ToolMode;
+
+static ToolMode   mode;
+static gint       jobs = 0;
+static gint       threads = 1;
+static gint       quality = 90;
+static gint       quality_alpha = 100;
+static gint       subsampling = 4;
+static gint       resiliency = 1;
+static gchar     *output_dir = NULL;
+static gchar    **files = NULL;
+static gint       failures = 0;
+static GMutex     output_mutex;
+
+static GOptionEntry entries[] =
+{
+	{ "jobs", 'j', 0, G_OPTION_ARG_INT, &jobs, "Files converted in parallel (default: number of CPUs)", "N" },
+	{ "threads", 't', 0, G_OPTION_ARG_INT, &threads, "Codec threads per file (default: 1)", "N" },
+	{ "quality", 'q', 0, G_OPTION_ARG_INT, &quality, "Encoding quality, 0-100 (default: 90)", "Q" },
+	{ "quality-alpha", 'a', 0, G_OPTION_ARG_INT, &quality_alpha, "Alpha encoding quality, 0-100 (default: 100)", "Q" },
+	{ "subsampling", 's', 0, G_OPTION_ARG_INT, &subsampling, "Chroma subsampling, 1-4 (default: 4)", "S" },
+	{ "resiliency", 'r', 0, G_OPTION_ARG_INT, &resiliency, "Error resiliency, 0-2 (default: 1)", "R" },
+	{ "output", 'o', 0, G_OPTION_ARG_FILENAME, &output_dir, "Output directory (default: next to the input)", "DIR" },
+	{ G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &files, NULL, "FILES..." },
+	{ NULL }
+};
+
+static void
+report (const gchar *filename,
+		GError      *error,
+		const gchar *format,
+		...) G_GNUC_PRINTF (3, 4);
+
+// one line per file, failures to stderr
+static void
+report (const gchar *filename,
+		GError      *error,
+		const gchar *format,
+		...)
+{
+	g_mutex_lock (&output_mutex);
+	if (error) {
+		g_printerr ("%s: %s\n", filename, error->message);
+		failures++;
+	}
+	else {
+		va_list  args;
+		gchar   *message;
+
+		va_start (args, format);
+		message = g_strdup_vprintf (format, args);
+		va_end (args);
+		g_print ("%s: %s\n", filename, message);
+		g_free (message);
+	}
+	g_mutex_unlock (&output_mutex);
+}
+
+// input file name with a new extension, in the output directory when there is one
+static gchar *
+output_name (const gchar *filename,
+		const gchar *suffix)
+{
+	gchar *base = g_path_get_basename (filename);
+	gchar *dir = output_dir ? g_strdup (output_dir) : g_path_get_dirname (filename);
+	gchar *dot = strrchr (base, '.');
+	gchar *name;
+	gchar *path;
+
+	if (dot)
+		*dot = 0;
+	name = g_strconcat (base, suffix, NULL);
+	path = g_build_filename (dir, name, NULL);
+	g_free (name);
+	g_free (dir);
+	g_free (base);
+	return path;
+}
+
+static void
+encode_file (const gchar *filename)
+{
+	GError          *error = NULL;
+	GdkPixbuf       *pixbuf;
+	QWICoreLayer     layer;
+	QWIEncodeParams  params;
+	const guchar    *src;
+	gchar           *outname;
+	gint             rowstride;
+	guint            row;
+
+	pixbuf = gdk_pixbuf_new_from_file (filename, &error);
+	if (!pixbuf) {
+		report (filename, error, NULL);
+		g_error_free (error);
+		return;
+	}
+
+	// gdk-pixbuf rows are padded: pack them
+	memset (&layer, 0, sizeof (layer));
+	layer.width = gdk_pixbuf_get_width (pixbuf);
+	layer.height = gdk_pixbuf_get_height (pixbuf);
+	layer.planes = gdk_pixbuf_get_n_channels (pixbuf);
+	layer.pixels = g_malloc ((gsize) layer.width * layer.height * layer.planes);
+	src = gdk_pixbuf_get_pixels (pixbuf);
+	rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+	for (row = 0; row < layer.height; row++)
+		memcpy (layer.pixels + (gsize) row * layer.width * layer.planes, src + (gsize) row * rowstride, layer.width * layer.planes);
+	g_object_unref (pixbuf);
+
+	params.subsampling = CLAMP (subsampling, 1, 4);
+	params.resiliency = CLAMP (resiliency, 0, 2);
+	params.toplayer = qwi_core_max_layers (layer.width, layer.height);
+	params.quality = CLAMP (quality, 0, 100);
+	params.qualityAlpha = CLAMP (quality_alpha, 0, 100);
+	params.duration = 0;
+
+	outname = output_name (filename, ".qwi");
+	if (qwi_core_save (outname, &layer, 1, layer.width, layer.height, 0, &params, NULL, &error))
+		report (filename, NULL, "%ux%u -> %s", layer.width, layer.height, outname);
+	else {
+		report (filename, error, NULL);
+		g_error_free (error);
+	}
+	g_free (outname);
+	g_free (layer.pixels);
+}
+
+// QWI elements are gray or RGB, with or without alpha; gdk-pixbuf only does RGB
+static GdkPixbuf *
+layer_to_pixbuf (const QWICoreLayer *layer)
+{
+	gboolean   alpha = !(layer->planes & 1);
+	GdkPixbuf *pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, alpha, 8, layer->width, layer->height);
+	guchar    *pixels = gdk_pixbuf_get_pixels (pixbuf);
+	gint       rowstride = gdk_pixbuf_get_rowstride (pixbuf);
+	guint      x, y;
+
+	for (y = 0; y < layer->height; y++) {
+		const guchar *src = layer->pixels + (gsize) y * layer->width * layer->planes;
+		guchar       *dst = pixels + (gsize) y * rowstride;
+
+		if (layer->planes > 2)
+			memcpy (dst, src, layer->width * layer->planes);
+		else
+			for (x = 0; x < layer->width; x++, src += layer->planes) {
+				*dst++ = src[0];
+				*dst++ = src[0];
+				*dst++ = src[0];
+				if (alpha)
+					*dst++ = src[1];
+			}
+	}
+	return pixbuf;
+}
+
+static void
+decode_file (const gchar *filename)
+{
+	GError       *error = NULL;
+	QWICoreLayer *layers;
+	QWI_ELEMENT   element;
+	guint         n_layers;
+	guint         i;
+
+	layers = qwi_core_load (filename, threads, &n_layers, &element, &error);
+	if (!layers) {
+		report (filename, error, NULL);
+		g_error_free (error);
+		return;
+	}
+
+	for (i = 0; i < n_layers && !error; i++) {
+		GdkPixbuf *pixbuf = layer_to_pixbuf (&layers[i]);
+		gchar     *suffix = n_layers > 1 ? g_strdup_printf ("-%u.png", i) : g_strdup (".png");
+		gchar     *outname = output_name (filename, suffix);
+
+		if (gdk_pixbuf_save (pixbuf, outname, "png", &error, NULL))
+			report (filename, NULL, "%ux%u+%d+%d -> %s", layers[i].width, layers[i].height,
+					layers[i].x, layers[i].y, outname);
+		g_free (outname);
+		g_free (suffix);
+		g_object_unref (pixbuf);
+	}
+	if (error) {
+		report (filename, error, NULL);
+		g_error_free (error);
+	}
+	qwi_core_layers_free (layers, n_layers);
+}
+
+static void
+info_file (const gchar *filename)
+{
+	GError      *error = NULL;
+	QWIPool     *pool = qwi_pool_new ();
+	QWIInput    *input;
+	QWIIndex    *index = NULL;
+	QWI_ELEMENT  element;
+	gchar       *code = NULL;
+	guint32      code_length;
+	guint32      qwi_error = 0;
+	GString     *info;
+	guint        i;
+
+	memset (&element, 0, sizeof (element));
+	input = qwi_input_open (filename, pool, &error);
+	if (input && qwi_core_read_header (input, filename, &element, &code, &code_length, &qwi_error, &error))
+		index = qwi_index_scan (input, &element, 0, &error);
+
+	if (!index) {
+		report (filename, error, NULL);
+		g_error_free (error);
+	}
+	else {
+		// the element table comes from the headers only, no bitstream is read
+		info = g_string_new (NULL);
+		g_string_append_printf (info, "%ux%u, type %d, format %d.%d, %u elements, %u bytes of code",
+				element.file.width, element.file.height, element.file.type,
+				(element.file.version>>16)&0xff, (element.file.version>>8)&0xff,
+				index->n_entries, code_length);
+		for (i = 0; i < index->n_entries; i++) {
+			QWI_ELEMENT *el = &index->entries[i].element;
+
+			g_string_append_printf (info, "\n  %u: %ux%u+%d+%d, %d planes, %d levels, %u bytes",
+					i, el->width, el->height, el->x, el->y, el->planes, el->toplayer, el->size);
+			if (element.file.type == QWI_TYPE_ANIMATE)
+				g_string_append_printf (info, ", %ums%s", qwi_core_get_duration (el->duration),
+						el->duration&0x8000 ? " (combine)" : "");
+			if (index->entries[i].name)
+				g_string_append_printf (info, ", \"%s\"", index->entries[i].name);
+		}
+		report (filename, NULL, "%s", info->str);
+		g_string_free (info, TRUE);
+		qwi_index_free (index);
+	}
+
+	g_free (code);
+	if (input)
+		qwi_input_close (input);
+	qwi_pool_free (pool);
+}
+
+static void
+run_job (gpointer data,
+		gpointer user_data)
+{
+	const gchar *filename = data;
+
+	switch (mode) {
+	case TOOL_ENCODE:
+		encode_file (filename);
+		break;
+	case TOOL_DECODE:
+		decode_file (filename);
+		break;
+	case TOOL_INFO:
+		info_file (filename);
+		break;
+	}
+}
+
+int
+main (int    argc,
+		char **argv)
+{
+	GOptionContext *context;
+	GThreadPool    *pool;
+	GError         *error = NULL;
+	gint            i;
+
+#if !GLIB_CHECK_VERSION(2,36,0)
+	g_type_init ();
+#endif
+
+	context = g_option_context_new ("encode|decode|info FILES... - convert QWI files in batch");
+	g_option_context_add_main_entries (context, entries, NULL);
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		g_printerr ("%s\n", error->message);
+		return 2;
+	}
+	g_option_context_free (context);
+
+	if (!files || !files[0] || !files[1]) {
+		g_printerr ("Usage: %s encode|decode|info [OPTION...] FILES...\n", argv[0]);
+		return 2;
+	}
+	if (!strcmp (files[0], "encode"))
+		mode = TOOL_ENCODE;
+	else if (!strcmp (files[0], "decode"))
+		mode = TOOL_DECODE;
+	else if (!strcmp (files[0], "info"))
+		mode = TOOL_INFO;
+	else {
+		g_printerr ("Unknown command '%s'\n", files[0]);
+		return 2;
+	}
+
+	if (jobs <= 0)
+		jobs = g_get_num_processors ();
+	threads = MAX (1, threads);
+
+	// the files are queued in order, and picked up by whichever worker is free
+	pool = g_thread_pool_new (run_job, NULL, jobs, TRUE, NULL);
+	for (i = 1; files[i]; i++)
+		g_thread_pool_push (pool, files[i], NULL);
+	g_thread_pool_free (pool, FALSE, TRUE);
+
+	g_strfreev (files);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,141 @@
+/* qwi-trace.c  Per thread ring buffers of spans, dumped for Chrome.  */
+
+/*
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "qwi-trace.h"
+
+#define TRACE_RING_SIZE  4096   /* spans kept per thread, the oldest are overwritten */
+
+typedef struct
+{
+	const gchar *name;
+	gint64       begin;
+	gint64       duration;
+	gint         element;
+} TraceSpan;
+
+// written by its thread only, read at exit once the workers are gone
+typedef struct _TraceRing TraceRing;
+struct _TraceRing
+{
+	TraceRing *next;
+	gint       tid;
+	guint64    head;        /* number of spans ever recorded */
+	TraceSpan  spans[TRACE_RING_SIZE];
+};
+
+static const gchar *trace_file = NULL;
+static TraceRing   *rings = NULL;
+static gint         next_tid = 0;
+static GPrivate     thread_ring = G_PRIVATE_INIT (NULL);
+
+// one file per process, QWI_TRACE.<pid>: plug-in runs don't overwrite each other
+static void
+trace_dump (void)
+{
+	gint       pid = getpid ();
+	gchar     *path = g_strdup_printf ("%s.%d", trace_file, pid);
+	FILE      *out = g_fopen (path, "w");
+	TraceRing *ring;
+	gboolean   first = TRUE;
+
+	g_free (path);
+	if (!out)
+		return;
+
+	fprintf (out, "{\"traceEvents\":[");
+	for (ring = g_atomic_pointer_get (&rings); ring; ring = ring->next) {
+		guint64 i = ring->head > TRACE_RING_SIZE ? ring->head - TRACE_RING_SIZE : 0;
+
+		fprintf (out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"qwi thread %d\"}}",
+				first ? "" : ",", pid, ring->tid, ring->tid);
+		first = FALSE;
+		for (; i < ring->head; i++) {
+			TraceSpan *span = &ring->spans[i % TRACE_RING_SIZE];
+
+			fprintf (out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%" G_GINT64_FORMAT ",\"dur\":%" G_GINT64_FORMAT,
+					span->name, pid, ring->tid, span->begin, span->duration);
+			if (span->element >= 0)
+				fprintf (out, ",\"args\":{\"element\":%d}", span->element);
+			fputc ('}', out);
+		}
+	}
+	fprintf (out, "\n]}\n");
+	fclose (out);
+}
+
+gboolean
+qwi_trace_enabled (void)
+{
+	static gsize initialized = 0;
+
+	if (g_once_init_enter (&initialized)) {
+		trace_file = g_getenv ("QWI_TRACE");
+		if (trace_file && *trace_file)
+			atexit (trace_dump);
+		else
+			trace_file = NULL;
+		g_once_init_leave (&initialized, 1);
+	}
+	return trace_file != NULL;
+}
+
+gint64
+qwi_trace_begin (void)
+{
+	return qwi_trace_enabled () ? g_get_monotonic_time () : 0;
+}
+
+void
+qwi_trace_end (const gchar *name,
+		gint         element,
+		gint64       begin)
+{
+	TraceRing *ring;
+	TraceSpan *span;
+
+	if (!qwi_trace_enabled ())
+		return;
+
+	ring = g_private_get (&thread_ring);
+	if (!ring) {
+		// first span of this thread: its ring goes at the head of the list, without a lock
+		ring = g_new0 (TraceRing, 1);
+		ring->tid = g_atomic_int_add (&next_tid, 1);
+		do
+			ring->next = g_atomic_pointer_get (&rings);
+		while (!g_atomic_pointer_compare_and_exchange (&rings, ring->next, ring));
+		g_private_set (&thread_ring, ring);
+	}
+
+	span = &ring->spans[ring->head % TRACE_RING_SIZE];
+	span->name = name;
+	span->begin = begin;
+	span->duration = g_get_monotonic_time () - begin;
+	span->element = element;
+	ring->head++;
+}
@@ -0,0 +1,39 @@
+/*
+ * GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __QWI_TRACE_H__
+#define __QWI_TRACE_H__
+
+/* Opt-in tracing: with QWI_TRACE set to a file name, spans are recorded
+ * on the monotonic clock into a ring buffer per thread (no lock on the
+ * recording path), and written at exit to that file name followed by the
+ * process id, in the Chrome trace event format, which chrome://tracing
+ * and Perfetto open.
+ */
+
+gboolean   qwi_trace_enabled  (void);
+
+/* A span runs from qwi_trace_begin to qwi_trace_end. name must be a
+ * static string; element goes in the span arguments unless it is -1.
+ */
+gint64     qwi_trace_begin    (void);
+void       qwi_trace_end      (const gchar  *name,
+                               gint          element,
+                               gint64        begin);
+
+#endif /* __QWI_TRACE_H__ */
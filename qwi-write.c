@@ -18,7 +18,6 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  * ----------------------------------------------------------------------------
  */
-#include <time.h>
 
 //#include "config.h"
 
@@ -31,7 +30,13 @@
 #include <libgimp/gimpui.h>
 
 #include "file-qwi.h"
+#include "qwi-simd.h"
 #include "qwi.h"
+#include "qwi-input.h"
+#include "qwi-optionals.h"
+#include "qwi-core.h"
+#include "qwi-stats.h"
+#include "qwi-trace.h"
 
 //#include "libgimp/stdplugins-intl.h"
 
@@ -45,6 +50,9 @@ typedef struct
 	GtkWidget     *resiliency;          /*resiliency side select*/
 	GtkWidget     *animate;             /*animate check box*/
 	GtkWidget     *duration;            /*duration text box*/
+	GtkWidget     *delta;               /*delta frames check box*/
+	GtkWidget     *autocrop;            /*autocrop check box*/
+	GtkWidget     *target_size;         /*target size spin*/
 	GtkTextBuffer *text_buffer;
 } QWISaveGui;
 
@@ -61,6 +69,9 @@ static struct
 	gint maxquality;
 	gint animate;
 	gint duration;
+	gint target_size;	/* bytes per layer, 0 = off */
+	gint delta;		/* animations: only encode what changed since the previous frame */
+	gint autocrop;		/* leave the transparent borders of the layers out */
 } QWISaveData;
 
 static gint    cur_progress = 0;
@@ -68,23 +79,337 @@ static gint    max_progress = 0;
 static GimpParasite *code_parasite = NULL;
 static gchar *globalcode = NULL;
 
-static guint16 set_duration (guint32 duration) 
+static  gboolean  save_dialog     (gint    channels);
+
+/* One layer travelling through the encoder pool. The buffers belong to the
+ * slot, not to the layer: they are kept for the next layer using the slot
+ * and only grow when a larger layer comes in. */
+typedef struct
+{
+	QWI_ELEMENT  element;   /* private copy, taken once the layer is set up */
+	QWI_ELEMENT  setup;     /* the same, before the encode, to see what the encode changed */
+	gshort      *data[4];   /* de-interleaved planes (data[0] owns the memory) */
+	gsize        data_size;
+	guchar      *buffer;    /* bitstream output */
+	gsize        buffer_size;
+	guint32      length;
+	guint32      qwi_error;
+	gint         index;     /* element number in the file */
+	QWIStats    *stats;
+	gboolean     done;
+	/* target size mode: what it takes to set the element up again at another quality */
+	gsize        target;    /* bytes, 0 = encode once at params.quality */
+	QWI_ELEMENT  base;      /* the shared element, before the layer was set up */
+	guint32      width;
+	guint32      height;
+	gint         x;
+	gint         y;
+	guchar       planes;
+	gboolean     rgb;
+	QWIEncodeParams params;
+	gchar       *layername;
+	gboolean     combine;   /* delta frame, drawn over the previous one */
+	gshort      *backup;    /* data[] as prepared, restored before each try */
+	gsize        backup_size;
+	guchar      *spare;     /* output of the current try */
+	gsize        spare_size;
+} QWIEncodeJob;
+
+/* Encodes tried by the target size search, the first one included */
+#define QWI_TARGET_TRIES 7
+
+/* Memory the encoder slots may hold at once: layers are encoded in
+ * parallel only as far as their buffers fit in it */
+#define QWI_SAVE_MEMORY  ((gsize) 1024 << 20)
+
+static GMutex encode_mutex;
+static GCond  encode_cond;
+
+static void
+reserve_job_buffer (guchar  **buffer,
+		gsize     *size,
+		gsize      needed,
+		QWIStats  *stats)
 {
-  if (duration < 164)
-    return 100*duration;
-  if (duration > 163830)
-    return 0x7fff;
-  return 0x4000 + (duration/10);
+	if (*size >= needed)
+		return;
+	g_free (*buffer);
+	*buffer = g_malloc (needed);
+	*size = needed;
+	qwi_stats_add_alloc (stats, 1, needed);
 }
 
-static guint32 get_duration (guint16 duration) 
+/* Emits the measure of a save, and leaves it on the image for the session */
+static void
+finish_stats (QWIStats *stats,
+		gint32    image)
 {
-  if (duration & 0x4000)
-    return (duration&0x3fff)*10;
-  return (duration&0x3fff)/100;
+	gchar *line = qwi_stats_finish (stats);
+
+	if (line) {
+		GimpParasite *parasite = gimp_parasite_new ("qwi-stats", 0, strlen (line) + 1, line);
+		gimp_image_attach_parasite (image, parasite);
+		gimp_parasite_free (parasite);
+		g_free (line);
+	}
 }
 
-static  gboolean  save_dialog     (gint    channels);
+/* Sets the element of a layer up at the given quality: the shared part, the
+ * duration of an animation frame or the layer name. Runs on the main thread
+ * for the first encode, and on the workers for the target size tries. */
+static void
+setup_layer (const QWIEncodeJob *job,
+		gint          quality,
+		QWI_ELEMENT  *element,
+		guchar       *buffer,
+		guint32      *qwi_error)
+{
+	QWIEncodeParams params = job->params;
+	gchar *layername = job->layername;
+
+	params.quality = quality;
+	*element = job->base;
+	qwi_core_set_element (element, job->width, job->height, job->x, job->y, job->planes, job->rgb, &params);
+
+	if (element->file.type == QWI_TYPE_ANIMATE) {
+		guint32 duration;
+		gchar *pName;
+		while((pName = strchr(layername, 0x28)) != 0) {
+			if (sscanf(pName, "(%ims)", &duration) > 0) {
+				element->duration = qwi_core_set_duration(duration);
+				break;
+			}
+			pName++;
+		}
+		if (job->combine || strstr(layername, "(combine)") != NULL)
+			element->duration |= 0x8000;
+	}
+	else if (element->file.type&1)
+		qwi_setOptionalSection(element, "NAM", 1, strlen(layername), (uint8_t*)layername, buffer, qwi_error);
+}
+
+/* Looks for the highest quality, up to the dialog one, that keeps the layer
+ * under job->target bytes. libqwi has no rate estimate, so each try is a real
+ * encode; the next quality is interpolated from the sizes that bracket the
+ * target, halfway to the middle of the bracket so that it always shrinks.
+ * When even quality 0 is too big, the smallest stream is kept.
+ * qwi_encode makes no promise to leave its planes alone (the transform may
+ * run in place), so the planes are saved as prepared before the first try
+ * and copied back before every other one: each try starts from the pixels,
+ * whatever the encoder did to them. data[0] holds all the planes. */
+static void
+encode_to_target (QWIEncodeJob *job)
+{
+	gsize   data_bytes = (gsize) job->planes * job->width * job->height * sizeof (gshort);
+	gint    lo = -1;                  /* best quality known to fit */
+	gint    hi = job->params.quality; /* lowest quality known not to */
+	guint32 lo_length = 0;
+	guint32 hi_length;
+	gint    tries;
+
+	memcpy (job->backup, job->data[0], data_bytes);
+	job->length = qwi_core_encode (&job->element, job->data, job->buffer, &job->qwi_error);
+	if (job->qwi_error || job->length <= job->target)
+		return;
+	hi_length = job->length;
+
+	for (tries = 1; tries < QWI_TARGET_TRIES && hi - lo > 1; tries++) {
+		QWI_ELEMENT element;
+		guchar *swap;
+		gsize   swap_size;
+		guint32 length;
+		guint32 qwi_error = 0;
+		gint    q;
+
+		if (lo < 0)
+			q = (gint) ((guint64) hi * job->target / hi_length);
+		else
+			q = lo + (gint) ((guint64) (hi - lo) * (job->target - lo_length) / (hi_length - lo_length));
+		q = (q + (lo + hi) / 2) / 2;
+		q = CLAMP (q, lo + 1, hi - 1);
+
+		memcpy (job->data[0], job->backup, data_bytes);
+		setup_layer (job, q, &element, job->spare, &qwi_error);
+		length = qwi_core_encode (&element, job->data, job->spare, &qwi_error);
+		if (qwi_error) {
+			job->qwi_error = qwi_error;
+			return;
+		}
+
+		// keep what fits, or anything smaller while nothing does
+		if (length <= job->target || lo < 0) {
+			swap = job->buffer;
+			job->buffer = job->spare;
+			job->spare = swap;
+			swap_size = job->buffer_size;
+			job->buffer_size = job->spare_size;
+			job->spare_size = swap_size;
+			job->element = element;
+			job->length = length;
+		}
+		if (length <= job->target) {
+			lo = q;
+			lo_length = length;
+		}
+		else {
+			hi = q;
+			hi_length = length;
+		}
+	}
+}
+
+/* Drops the alpha channel of a whole frame when it is opaque everywhere, a
+ * row at a time as the planes are checked (row_opaque), so that the frame
+ * can take part in delta coding. FALSE, and the frame untouched, when some
+ * pixel shows through. */
+static gboolean
+frame_strip_alpha (guchar *frame,
+		gint    width,
+		gint    height,
+		guint   planes)
+{
+	gsize i, n = (gsize) width * height;
+	gint  row, col;
+	guint plane;
+
+	for (row = 0; row < height; row++) {
+		const guchar *alpha = frame + (gsize) row * width * planes + planes - 1;
+		guchar        all = 255;
+
+		for (col = 0; col < width; col++)
+			all &= alpha[(gsize) col * planes];
+		if (all != 255)
+			return FALSE;
+	}
+	for (i = 0; i < n; i++)
+		for (plane = 0; plane < planes - 1; plane++)
+			frame[i * (planes - 1) + plane] = frame[i * planes + plane];
+	return TRUE;
+}
+
+/* Bounding box of the pixels that changed between two frames of the same
+ * size, FALSE when they are identical */
+static gboolean
+frame_diff_bounds (const guchar *frame,
+		const guchar *prev,
+		gint          width,
+		gint          height,
+		gint          bpp,
+		gint         *bx,
+		gint         *by,
+		gint         *bw,
+		gint         *bh)
+{
+	gsize stride = (gsize) width * bpp;
+	gint  top;
+	gint  bottom;
+	gint  left = width;
+	gint  right = -1;
+	gint  row;
+
+	for (top = 0; top < height && !memcmp (frame + top * stride, prev + top * stride, stride); top++)
+		;
+	if (top == height)
+		return FALSE;
+	for (bottom = height - 1; !memcmp (frame + bottom * stride, prev + bottom * stride, stride); bottom--)
+		;
+
+	// the rows in between only need scanning up to the columns already known to change
+	for (row = top; row <= bottom; row++) {
+		const guchar *a = frame + row * stride;
+		const guchar *b = prev + row * stride;
+		gint i;
+
+		for (i = 0; i < left && !memcmp (a + i * bpp, b + i * bpp, bpp); i++)
+			;
+		left = i;
+		for (i = width - 1; i > right && !memcmp (a + i * bpp, b + i * bpp, bpp); i--)
+			;
+		right = i;
+	}
+
+	*bx = left;
+	*by = top;
+	*bw = right - left + 1;
+	*bh = bottom - top + 1;
+	return TRUE;
+}
+
+/* Bounding box of the pixels of a drawable with alpha that are not fully
+ * transparent, read a tile at a time. FALSE when there is none. */
+static gboolean
+alpha_bounds (GimpDrawable *drawable,
+		gint          planes,
+		gint         *bx,
+		gint         *by,
+		gint         *bw,
+		gint         *bh)
+{
+	GimpPixelRgn pixel_rgn;
+	gpointer     pr;
+	gint         left = drawable->width;
+	gint         right = 0;
+	gint         top = drawable->height;
+	gint         bottom = 0;
+
+	gimp_tile_cache_ntiles (2 * (drawable->width / gimp_tile_width () + 1));
+	gimp_pixel_rgn_init (&pixel_rgn, drawable, 0, 0, drawable->width, drawable->height, FALSE, FALSE);
+	for (pr = gimp_pixel_rgns_register (1, &pixel_rgn); pr != NULL; pr = gimp_pixel_rgns_process (pr))
+	{
+		gint row;
+		const guchar *src = pixel_rgn.data;
+		for (row = 0; row < pixel_rgn.h; row++, src += pixel_rgn.rowstride)
+		{
+			guint32 first, end;
+			if (!qwi_alpha_span (src, planes, pixel_rgn.w, &first, &end))
+				continue;
+			left   = MIN (left, pixel_rgn.x + (gint) first);
+			right  = MAX (right, pixel_rgn.x + (gint) end);
+			top    = MIN (top, pixel_rgn.y + row);
+			bottom = MAX (bottom, pixel_rgn.y + row + 1);
+		}
+	}
+	if (left >= right)
+		return FALSE;
+
+	*bx = left;
+	*by = top;
+	*bw = right - left;
+	*bh = bottom - top;
+	return TRUE;
+}
+
+// checked on the plane just written, while it is still in cache
+static inline gboolean
+row_opaque (const gshort *alpha,
+		gint          n)
+{
+	gshort all = 255;
+	gint   i;
+
+	for (i = 0; i < n; i++)
+		all &= alpha[i];
+	return all == 255;
+}
+
+static void
+encode_job (gpointer job_data,
+		gpointer user_data)
+{
+	QWIEncodeJob *job = job_data;
+	gint64        begin = qwi_stats_begin (job->stats);
+
+	if (job->target)
+		encode_to_target (job);
+	else
+		job->length = qwi_core_encode (&job->element, job->data, job->buffer, &job->qwi_error);
+	qwi_stats_end (job->stats, QWI_STAGE_ENCODE, job->index, begin);
+
+	g_mutex_lock (&encode_mutex);
+	job->done = TRUE;
+	g_cond_broadcast (&encode_cond);
+	g_mutex_unlock (&encode_mutex);
+}
 
 GimpPDBStatusType
 WriteQWI (const gchar  *filename,
@@ -94,7 +419,7 @@ WriteQWI (const gchar  *filename,
 {
 	FILE          *outfile;
 	guchar        *buffer;
-	guchar        *pixels;
+	gpointer       pr;
 	gint32 		  *layers;
 	gint 		   elements;
 	GimpPixelRgn   pixel_rgn;
@@ -105,15 +430,27 @@ WriteQWI (const gchar  *filename,
 	gint32         height;
 	gint           x;
 	gint           y;
-	gshort        *data[4];
 	QWI_ELEMENT    element;
 	guchar 		   planes = 0;
-	guchar 		   colorspace;
-#if !defined(WIN32) && !defined(__MINGW32__)
-	struct timespec now, tmstart;
-	double seconds;
-#endif
+	gboolean 	   rgb;
+	QWIEncodeParams params;
+	gint64         save_begin = 0;
 	guint32 qwi_error = 0;
+	QWIEncodeJob  *jobs;
+	GThreadPool   *pool = NULL;
+	gint           window;
+	gsize          slot_size;   /* memory of an encoder slot, for the largest layer */
+	gint           in_flight;   /* layers set up but not written yet */
+	gint           job_in;
+	gint           job_out;
+	GimpPDBStatusType status = GIMP_PDB_SUCCESS;
+	QWIStats      *stats;
+	gint64         begin;
+	guchar        *frame = NULL;      /* delta frames: the current frame, whole */
+	gsize          frame_size = 0;
+	guchar        *prev_frame = NULL; /* and the previous one, when it is what the viewer shows */
+	gsize          prev_frame_size = 0;
+	gboolean       prev_valid = FALSE;
 
 	memset(&element, 0, sizeof(QWI_ELEMENT));
 
@@ -130,6 +467,9 @@ WriteQWI (const gchar  *filename,
 	QWISaveData.subsampling = 0;
 	QWISaveData.animate     = 0;
 	QWISaveData.duration    = 0;
+	QWISaveData.target_size = 0;
+	QWISaveData.delta       = 0;
+	QWISaveData.autocrop    = 0;
 
 	if (drawable_type == GIMP_RGBA_IMAGE || drawable_type == GIMP_RGB_IMAGE)
 		planes = 3;
@@ -144,22 +484,17 @@ WriteQWI (const gchar  *filename,
 
 	if (qwi_interactive || qwi_lastvals)
 		gimp_get_data (SAVE_PROC, &QWISaveData);
+	if (qwi_target_size >= 0)
+		QWISaveData.target_size = qwi_target_size;
 
 	QWISaveData.elements    = elements;
 	QWISaveData.maxquality    = 100;
-	QWISaveData.maxlayers   = QWI_MAX_LAYERS-1;
-	while (CEIL_RSHIFT(width, QWISaveData.maxlayers) < 32 && QWISaveData.maxlayers)
-		QWISaveData.maxlayers--;
-	while (CEIL_RSHIFT(height, QWISaveData.maxlayers) < 32 && QWISaveData.maxlayers)
-		QWISaveData.maxlayers--;
-	QWISaveData.maxlayers++;
+	QWISaveData.maxlayers   = qwi_core_max_layers (width, height);
 
 	if (qwi_interactive && !save_dialog (planes))
 		return GIMP_PDB_CANCEL;
 
-#if !defined(WIN32) && !defined(__MINGW32__)
-	clock_gettime(CLOCK_REALTIME, &tmstart);
-#endif
+	save_begin = qwi_trace_begin ();
 
 	QWISaveData.quality = QWISaveData.quality < 0 ? 0 : QWISaveData.quality > 100 ? 100 : QWISaveData.quality;
 	QWISaveData.qualityAlpha = QWISaveData.qualityAlpha < 0 ? 0 : QWISaveData.qualityAlpha > 100 ? 100 : QWISaveData.qualityAlpha;
@@ -168,10 +503,20 @@ WriteQWI (const gchar  *filename,
 	QWISaveData.subsampling = QWISaveData.subsampling < 0 ? 0 : QWISaveData.subsampling > 4 ? 0 : QWISaveData.subsampling;
 	QWISaveData.subsampling = planes < 3 ? 1 : QWISaveData.subsampling;
 	QWISaveData.animate = QWISaveData.elements > 1 ? (QWISaveData.animate ? 1 : 0) : 0;
-	QWISaveData.duration = QWISaveData.animate ? get_duration(set_duration(QWISaveData.duration)) : 0;
+	QWISaveData.duration = QWISaveData.animate ? qwi_core_get_duration(qwi_core_set_duration(QWISaveData.duration)) : 0;
+	QWISaveData.target_size = QWISaveData.target_size < 0 ? 0 : QWISaveData.target_size;
+	QWISaveData.delta = QWISaveData.animate ? (QWISaveData.delta ? 1 : 0) : 0;
+	QWISaveData.autocrop = QWISaveData.autocrop ? 1 : 0;
 
 	gimp_set_data (SAVE_PROC, &QWISaveData, sizeof (QWISaveData));
 
+	params.subsampling  = QWISaveData.subsampling;
+	params.resiliency   = QWISaveData.resiliency;
+	params.toplayer     = QWISaveData.toplayer;
+	params.quality      = QWISaveData.quality;
+	params.qualityAlpha = QWISaveData.qualityAlpha;
+	params.duration     = qwi_core_set_duration (QWISaveData.duration);
+
   if (code_parasite) {
     gimp_image_detach_parasite (image, "code");
     gimp_parasite_free(code_parasite);
@@ -187,12 +532,14 @@ WriteQWI (const gchar  *filename,
 	gimp_progress_init_printf ("Saving '%s'",
 			gimp_filename_to_utf8 (filename));
 
+	stats = qwi_stats_new ("save", filename);
 	outfile = g_fopen (filename, "wb");
 	if (!outfile)
 	{
 		g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
 				"Could not open '%s' for writing: %s",
 				gimp_filename_to_utf8 (filename), g_strerror (errno));
+		finish_stats (stats, image);
 		return GIMP_PDB_EXECUTION_ERROR;
 	}
 
@@ -209,159 +556,305 @@ WriteQWI (const gchar  *filename,
 
 	// Any File optional section shall be set here
 	if (globalcode && strlen(globalcode)) {
-		char *option;
-		char *optionend = globalcode;
-		buffer = g_malloc(strlen(globalcode) + 256);
-		// set PAGE section(s)
-		while ((option = strstr(optionend, "<page>")) != NULL) {
-			guint32 length;
-			optionend = strstr(option, "</page>");
-			if (optionend == (char*)NULL) {
-				g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
-						"Missing </page> tag in code");
-				return GIMP_PDB_EXECUTION_ERROR;
-			}
-			length = (guint32)(optionend - option) - 6;
-			length = qwi_setOptionalSection(&element, "PAG", 0, length, (uint8_t*)option+6, buffer, &qwi_error);
-		}
-		// set FONT section(s)
-		optionend = globalcode;
-		while ((option = strstr(optionend, "<font>")) != NULL) {
-			guint32 length;
-			optionend = strstr(option, "</font>");
-			if (optionend == (char*)NULL) {
-				g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
-						"Missing </font> tag in code");
-				return GIMP_PDB_EXECUTION_ERROR;
-			}
-			length = (guint32)(optionend - option) - 6;
-			length = qwi_setOptionalSection(&element, "FNT", 0, length, (uint8_t*)option+6, buffer, &qwi_error);
-		}
-		// set CODE section(s)
-		optionend = globalcode;
-		while ((option = strstr(optionend, "<code>")) != NULL) {
-			guint32 length;
-			optionend = strstr(option, "</code>");
-			if (optionend == (char*)NULL) {
-				g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
-						"Missing </code> tag in code");
-				return GIMP_PDB_EXECUTION_ERROR;
-			}
-			length = (guint32)(optionend - option) - 6;
-			length = qwi_setOptionalSection(&element, "COD", 0, length, (uint8_t*)option+6, buffer, &qwi_error);
-		}
-		fwrite(buffer, element.file.optionals, 1, outfile);
-		g_free(buffer);
+		gboolean written;
+		begin = qwi_stats_begin (stats);
+		written = qwi_optionals_write (&element, globalcode, outfile, error);
+		qwi_stats_end (stats, QWI_STAGE_OPTIONALS, -1, begin);
+		qwi_stats_add_bytes (stats, 0, element.file.optionals);
     g_free(globalcode);
     globalcode = NULL;
+		if (!written) {
+			fclose (outfile);
+			g_unlink (filename);
+			finish_stats (stats, image);
+			return GIMP_PDB_EXECUTION_ERROR;
+		}
 	}
 
   // Now, the elements (the gimp layers)
-	for (; elements; elements--) {
-		guint32 length;
-		guint plane;
-		gchar *layername;
-		drawable = gimp_drawable_get (layers[elements-1]);
-		drawable_type   = gimp_drawable_type (layers[elements-1]);
-
-		width  = drawable->width;
-		height = drawable->height;
-		gimp_drawable_offsets(layers[elements-1], &x, &y);
-
-		if (drawable_type == GIMP_RGBA_IMAGE || drawable_type == GIMP_RGB_IMAGE) {
-			planes = 3;
-			colorspace = QWI_COLORSPACE_RGBx;
-		}
-		else {
-			planes = 1;
-			colorspace = QWI_COLORSPACE_YUVx;
-		}
-		if (drawable_type == GIMP_RGBA_IMAGE || drawable_type == GIMP_GRAYA_IMAGE)
-			planes++;
-
-    // allocate some memory for the bitstream output
-    // (we don't know how much, and expect that the compression process will not diverge too much...)
-		buffer = g_malloc(MAX(8192, width * height * (planes + 1)));
-
-		//set the description element structure
-		qwi_setElement(&element, width, height, x, y, planes, QWISaveData.subsampling-1, colorspace, 8,
-				QWISaveData.quality, -1, QWISaveData.toplayer-1, 0, QWISaveData.resiliency, set_duration(QWISaveData.duration));
-
-		//set the layer optionals (here, the layer name)
-		layername = gimp_item_get_name (layers[elements-1]);
-		if (element.file.type == QWI_TYPE_ANIMATE) {
-			guint32 duration;
-			gchar *pName;
-      while((pName = strchr(layername, 0x28)) != 0) {
-			  if (sscanf(pName, "(%ims)", &duration) > 0) {
-    			element.duration = set_duration(duration);
-          break;
-        }
-        pName++;
-      }
-			if (strstr(layername, "(combine)") != NULL)
-        element.duration |= 0x8000;
-		}
-		else if (element.file.type&1)
-			qwi_setOptionalSection(&element, "NAM", 1, strlen(layername), (uint8_t*)layername, buffer, &qwi_error);
-
-    // allocate some memory for the coding process
-		data[0] = g_malloc (planes * width * height * sizeof (gshort));
-		for (plane = 1; plane < planes; plane++)
-			data[plane] = data[plane-1] + width * height;
-
+  // Pixels are fetched on this thread (libgimp is not thread safe) and handed to a
+  // pool of encoders; the bitstreams are written back in layer order.
+	// every slot grows to the largest layer: bitstream bound and planes, and in target size mode
+	// a backup of the planes and a spare bitstream too
+	slot_size = 0;
+	for (job_in = 0; job_in < elements; job_in++) {
+		guint32 w = gimp_drawable_width (layers[job_in]);
+		guint32 h = gimp_drawable_height (layers[job_in]);
+		guchar  p = (gimp_drawable_is_rgb (layers[job_in]) ? 3 : 1) + (gimp_drawable_has_alpha (layers[job_in]) ? 1 : 0);
+
+		slot_size = MAX (slot_size, qwi_core_encode_bound (w, h, p) + (gsize) w * h * p * sizeof (gshort));
+	}
+	if (QWISaveData.target_size)
+		slot_size *= 2;
+	window = MIN (qwi_threads, elements);
+	window = MAX (1, MIN ((gsize) window, QWI_SAVE_MEMORY / MAX (slot_size, 1)));
+	qwi_stats_set_threads (stats, qwi_threads);
+	jobs = g_new0 (QWIEncodeJob, window);
+	if (window > 1)
+		pool = g_thread_pool_new (encode_job, NULL, window, FALSE, NULL);
+	// the first layer goes alone, to learn whether the encode updates the file header
+	// fields: if it does, the next layer can only be set up once the previous one is encoded
+	in_flight = 1;
+
+	for (job_in = job_out = 0; job_out < elements; ) {
+		QWIEncodeJob *job;
+
+		if (job_in < elements && job_in - job_out < in_flight) {
+			guint plane;
+			gint32 layer = layers[elements - 1 - job_in];
+			gint   crop_x = 0;
+			gint   crop_y = 0;
+			gint   layer_width;
+			gboolean delta;
+			gboolean opaque;
+
+			job = &jobs[job_in % window];
+			drawable = gimp_drawable_get (layer);
+			drawable_type   = gimp_drawable_type (layer);
+
+			width  = drawable->width;
+			height = drawable->height;
+			gimp_drawable_offsets(layer, &x, &y);
+
+			rgb = drawable_type == GIMP_RGBA_IMAGE || drawable_type == GIMP_RGB_IMAGE;
+			planes = rgb ? 3 : 1;
+			if (drawable_type == GIMP_RGBA_IMAGE || drawable_type == GIMP_GRAYA_IMAGE)
+				planes++;
+			layer_width = width;
+			g_free (job->layername);
+			job->layername = gimp_item_get_name (layer);
+			job->combine = FALSE;
+
+			// delta frames: an opaque frame covering the canvas is encoded as the box that
+			// changed since the previous one, drawn over it (combine)
+			delta = QWISaveData.delta && x == 0 && y == 0
+					&& width == element.file.width && height == element.file.height
+					&& strstr (job->layername, "(combine)") == NULL;
+			if (delta) {
+				begin = qwi_stats_begin (stats);
+				reserve_job_buffer (&frame, &frame_size, (gsize) width * height * planes, stats);
+				gimp_pixel_rgn_init (&pixel_rgn, drawable, 0, 0, width, height, FALSE, FALSE);
+				gimp_pixel_rgn_get_rect (&pixel_rgn, frame, 0, 0, width, height);
+
+				// most animation layers have an alpha channel: it only rules the frame out when it is used
+				if (planes != (rgb ? 3 : 1)) {
+					delta = frame_strip_alpha (frame, width, height, planes);
+					if (delta)
+						planes--;
+				}
+				qwi_stats_end (stats, QWI_STAGE_TRANSFER, job_in, begin);
+			}
+			if (delta) {
+				gint bx, by, bw, bh;
+
+				if (prev_valid) {
+					// an unchanged frame still needs an element for its duration
+					if (!frame_diff_bounds (frame, prev_frame, width, height, planes, &bx, &by, &bw, &bh))
+						bx = by = 0, bw = bh = 1;
+					// a box close to the whole frame is not worth losing the key frame
+					if ((gint64) bw * bh * 4 <= (gint64) width * height * 3) {
+						crop_x = bx;
+						crop_y = by;
+						width  = bw;
+						height = bh;
+						x += bx;
+						y += by;
+						job->combine = TRUE;
+					}
+				}
+			}
+			else if (QWISaveData.autocrop && planes != (rgb ? 3 : 1)) {
+				gint bx, by, bw, bh;
+
+				// a fully transparent layer is kept as one pixel, for its name and duration
+				begin = qwi_stats_begin (stats);
+				if (!alpha_bounds (drawable, planes, &bx, &by, &bw, &bh))
+					bx = by = 0, bw = bh = 1;
+				qwi_stats_end (stats, QWI_STAGE_TRANSFER, job_in, begin);
+				crop_x = bx;
+				crop_y = by;
+				width  = bw;
+				height = bh;
+				x += bx;
+				y += by;
+			}
 
-		gimp_pixel_rgn_init (&pixel_rgn, drawable, 0, 0, drawable->width, drawable->height, FALSE, FALSE);
-		pixels = g_new (guchar, width * height * planes);
-		gimp_pixel_rgn_get_rect (&pixel_rgn, pixels, 0, 0, drawable->width, drawable->height);
+      // allocate some memory for the bitstream output
+			reserve_job_buffer (&job->buffer, &job->buffer_size, qwi_core_encode_bound (width, height, planes), stats);
 
-		// initialize the coding process memory with the current layer pixels
-		for (plane = 0; plane < planes; plane++)
-		{
-			guint32 i;
-			guchar *p = pixels + plane;
-			gint16 *q = data[plane];
-			for (i = 0; i < width * height; i++, p+=planes, q++)
-				*q = *p;
+      // allocate some memory for the coding process
+			reserve_job_buffer ((guchar **) &job->data[0], &job->data_size, planes * width * height * sizeof (gshort), stats);
+			job->target = QWISaveData.target_size;
+			if (job->target) {
+				reserve_job_buffer ((guchar **) &job->backup, &job->backup_size, planes * width * height * sizeof (gshort), stats);
+				reserve_job_buffer (&job->spare, &job->spare_size, job->buffer_size, stats);
+			}
+			for (plane = 1; plane < planes; plane++)
+				job->data[plane] = job->data[plane-1] + width * height;
+
+
+			// initialize the coding process memory with the current layer pixels (or its cropped part),
+			// one tile at a time (no whole-layer copy of the pixels, and the transfers from the core
+			// stay tile sized), or from the whole frame a delta frame was compared with
+			begin = qwi_stats_begin (stats);
+			opaque = planes != (rgb ? 3 : 1);
+			if (delta) {
+				guchar *swap;
+				gsize   swap_size;
+				gint    row;
+				for (row = 0; row < height; row++)
+				{
+					guint32 offset = row * width;
+					gshort *dst[4];
+					for (plane = 0; plane < planes; plane++)
+						dst[plane] = job->data[plane] + offset;
+					qwi_deinterleave (frame + ((gsize) (crop_y + row) * layer_width + crop_x) * planes, planes, dst, width);
+				}
+
+				// the viewer now shows this frame
+				swap = prev_frame;
+				prev_frame = frame;
+				frame = swap;
+				swap_size = prev_frame_size;
+				prev_frame_size = frame_size;
+				frame_size = swap_size;
+			}
+			else {
+				gimp_tile_cache_ntiles (2 * (width / gimp_tile_width () + 1));
+				gimp_pixel_rgn_init (&pixel_rgn, drawable, crop_x, crop_y, width, height, FALSE, FALSE);
+				for (pr = gimp_pixel_rgns_register (1, &pixel_rgn); pr != NULL; pr = gimp_pixel_rgns_process (pr))
+				{
+					gint row;
+					const guchar *src = pixel_rgn.data;
+					for (row = 0; row < pixel_rgn.h; row++, src += pixel_rgn.rowstride)
+					{
+						guint32 offset = (pixel_rgn.y - crop_y + row) * width + pixel_rgn.x - crop_x;
+						gshort *dst[4];
+						for (plane = 0; plane < planes; plane++)
+							dst[plane] = job->data[plane] + offset;
+						qwi_deinterleave (src, planes, dst, pixel_rgn.w);
+						if (opaque)
+							opaque = row_opaque (dst[planes-1], pixel_rgn.w);
+					}
+				}
+			}
+			prev_valid = delta;
+			gimp_drawable_detach (drawable);
+			qwi_stats_end (stats, QWI_STAGE_TRANSFER, job_in, begin);
+
+			// an alpha channel opaque everywhere is not worth a plane (it is the last one)
+			if (opaque)
+				planes--;
+
+			//set the description element structure, and the layer optionals (here, the layer name)
+			job->base   = element;
+			job->width  = width;
+			job->height = height;
+			job->x      = x;
+			job->y      = y;
+			job->planes = planes;
+			job->rgb    = rgb;
+			job->params = params;
+			setup_layer (job, params.quality, &element, job->buffer, &qwi_error);
+
+			// encode the element on a private copy, the shared one keeps the file bookkeeping
+			job->element = element;
+			job->setup = element;
+			job->index = job_in;
+			job->stats = stats;
+			job->done = FALSE;
+			job_in++;
+			if (pool)
+				g_thread_pool_push (pool, job, NULL);
+			else
+				encode_job (job, NULL);
+			continue;
 		}
-		g_free (pixels);
 
-		// encode the element
-		length = qwi_encode (&element, 1, 0, QWI_MAX_LAYERS, data, buffer, &qwi_error);
-		if (qwi_error) {
-			g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (qwi_error),
+		// wait for the oldest element, and write it to disk
+		job = &jobs[job_out % window];
+		g_mutex_lock (&encode_mutex);
+		while (!job->done)
+			g_cond_wait (&encode_cond, &encode_mutex);
+		g_mutex_unlock (&encode_mutex);
+
+		if (job->qwi_error) {
+			g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (job->qwi_error),
 					"Could not allocate memory when processing: %s",
 					gimp_filename_to_utf8 (filename));
-			return GIMP_PDB_EXECUTION_ERROR;
+			status = GIMP_PDB_EXECUTION_ERROR;
+			break;
 		}
 		// Write data to disk
-		Write (outfile, buffer, length);
-    element.file.top = MAX(element.file.top, element.toplayer);
+		begin = qwi_stats_begin (stats);
+		if (job->length && !Write (outfile, job->buffer, job->length)) {
+			g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+					"Could not write '%s': %s",
+					gimp_filename_to_utf8 (filename), g_strerror (errno));
+			status = GIMP_PDB_EXECUTION_ERROR;
+			break;
+		}
+		qwi_stats_end (stats, QWI_STAGE_WRITE, job->index, begin);
+		qwi_stats_add_bytes (stats, 0, job->length);
+
+		// one layer at a time, the file state the encode leaves goes on to the next layer,
+		// as it does in a serial save; layers only overlap when the encode leaves it alone
+		if (in_flight == 1) {
+			if (job_out == 0 && !memcmp (&job->element.file, &job->setup.file, sizeof (job->element.file)))
+				in_flight = window;
+			else
+				element.file = job->element.file;
+		}
+		qwi_core_file_add_element (&element, &job->element);
 
-		g_free (data[0]);
-		g_free (buffer);
+		job_out++;
 		cur_progress++;
 		gimp_progress_update (((gdouble)cur_progress)/max_progress);
 	}
 
+	if (pool)
+		g_thread_pool_free (pool, FALSE, TRUE);
+	for (job_in = 0; job_in < window; job_in++) {
+		g_free (jobs[job_in].data[0]);
+		g_free (jobs[job_in].buffer);
+		g_free (jobs[job_in].backup);
+		g_free (jobs[job_in].spare);
+		g_free (jobs[job_in].layername);
+	}
+	g_free (jobs);
+	g_free (frame);
+	g_free (prev_frame);
+	if (status != GIMP_PDB_SUCCESS) {
+		fclose (outfile);
+		g_unlink (filename);
+		finish_stats (stats, image);
+		return status;
+	}
+
 	gimp_progress_update (1.0);
 	// write the file header, now that it is valid
 	fseek(outfile, 0, SEEK_SET);
 	buffer = g_malloc(QWI_FILE_HEADER_SIZE);
 	qwi_setFileHeader(&element, buffer);
-	(void) Write (outfile, buffer, QWI_FILE_HEADER_SIZE);
+	if (!Write (outfile, buffer, QWI_FILE_HEADER_SIZE) || fflush (outfile) != 0) {
+		g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+				"Could not write '%s': %s",
+				gimp_filename_to_utf8 (filename), g_strerror (errno));
+		g_free (buffer);
+		fclose (outfile);
+		g_unlink (filename);
+		finish_stats (stats, image);
+		return GIMP_PDB_EXECUTION_ERROR;
+	}
 	g_free(buffer);
+	qwi_stats_add_bytes (stats, 0, QWI_FILE_HEADER_SIZE);
 
 
 	fseek(outfile, 0, SEEK_END);
-	fflush(outfile);
 	fclose (outfile);
 
-#if !defined(WIN32) && !defined(__MINGW32__)
-	clock_gettime(CLOCK_REALTIME, &now);
-	seconds = (double)((now.tv_sec+now.tv_nsec*1e-9) - (double)(tmstart.tv_sec+tmstart.tv_nsec*1e-9));
-	printf("QWI file encoded in %fs\n", seconds);
-#endif
+	qwi_trace_end ("save", -1, save_begin);
+	finish_stats (stats, image);
 	return GIMP_PDB_SUCCESS;
 }
 
@@ -369,23 +862,16 @@ static void
 load_preset (GtkWidget *w, QWISaveGui *pg)
 {
 	gint idx;
-	const int presets[][5] = {
-			{0, 100, 100, 1, 0}, // drawing
-			{0, 100, 100, 0, 0}, // Archive lossless
-			{0, 90, 100, -1, 1}, // Archive photo good
-			{1, 90, 100, -1, 4},  // Web photo good
-			{1, 80, 100, -1, 4},  // Web photo smaller
-	};
-
-	if (!gimp_int_combo_box_get_active(GIMP_INT_COMBO_BOX(pg->preset), &idx) || idx < 0)
+
+	if (!gimp_int_combo_box_get_active(GIMP_INT_COMBO_BOX(pg->preset), &idx) || idx < 0 || idx >= QWI_N_PRESETS)
 		return;
 
 	QWISaveData.preset = idx;
-	QWISaveData.resiliency = presets[idx][0];
-	QWISaveData.quality = presets[idx][1];
-	QWISaveData.qualityAlpha = presets[idx][2];
-	QWISaveData.toplayer = presets[idx][3] < 0 ? QWISaveData.maxlayers : presets[idx][3];
-	QWISaveData.subsampling = presets[idx][4];
+	QWISaveData.resiliency = qwi_presets[idx].resiliency;
+	QWISaveData.quality = qwi_presets[idx].quality;
+	QWISaveData.qualityAlpha = qwi_presets[idx].qualityAlpha;
+	QWISaveData.toplayer = qwi_presets[idx].toplayer < 0 ? QWISaveData.maxlayers : qwi_presets[idx].toplayer;
+	QWISaveData.subsampling = qwi_presets[idx].subsampling;
 
 	gtk_adjustment_set_value (GTK_ADJUSTMENT (pg->quality),
 			QWISaveData.quality);
@@ -399,6 +885,13 @@ load_preset (GtkWidget *w, QWISaveGui *pg)
 			QWISaveData.subsampling);
 }
 
+static void
+target_size_update (GtkAdjustment *adjustment,
+		gint          *target_size)
+{
+	*target_size = (gint) gtk_adjustment_get_value (adjustment) * 1024;
+}
+
 static gboolean
 save_dialog (gint channels)
 {
@@ -491,6 +984,24 @@ save_dialog (gint channels)
 			G_CALLBACK (gimp_uint_adjustment_update),
 			&QWISaveData.qualityAlpha);
 
+	/* target size spin */
+	label = gtk_label_new_with_mnemonic ("_Target size per layer (KiB, 0 = off):");
+	gtk_misc_set_alignment (GTK_MISC (label), 0.0, 0.5);
+	gtk_table_attach (GTK_TABLE (table), label, 0, 1, 3, 4,
+			GTK_FILL, GTK_FILL, 0, 0);
+	gtk_widget_show (label);
+
+	adjustment = (GtkAdjustment*)gtk_adjustment_new(QWISaveData.target_size / 1024, 0.0, 1048576.0, 1.0, 16.0, 0.0);
+	pg.target_size = spin = gtk_spin_button_new (adjustment, 1.0, 0);
+	gimp_help_set_help_data (spin, "Lowers the quality until each layer fits, the quality above is the highest tried", NULL);
+	gtk_table_attach (GTK_TABLE (table), spin, 1, 2, 3, 4,
+			GTK_FILL, GTK_FILL, 0, 0);
+	gtk_widget_show (spin);
+	gtk_label_set_mnemonic_widget (GTK_LABEL (label), spin);
+	g_signal_connect (adjustment, "value-changed",
+			G_CALLBACK (target_size_update),
+			&QWISaveData.target_size);
+
 	if (QWISaveData.elements > 1)
 	{
 		/* animate checkbox */
@@ -523,6 +1034,15 @@ save_dialog (gint channels)
 		g_signal_connect (adjustment, "value-changed",
 				G_CALLBACK (gimp_int_adjustment_update),
 				&QWISaveData.duration);
+
+		/* delta frames checkbox */
+		pg.delta = check = gtk_check_button_new_with_mnemonic ("_Delta frames (only encode what changed)");
+		gtk_box_pack_start (GTK_BOX (vbox_main), check, FALSE, FALSE, 0);
+		gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (check), QWISaveData.delta);
+		gtk_widget_show (check);
+		g_signal_connect (check, "toggled",
+				G_CALLBACK (gimp_toggle_button_update),
+				&QWISaveData.delta);
 	}
 
 	/* Advanced Options */
@@ -622,6 +1142,15 @@ save_dialog (gint channels)
 				G_CALLBACK (gimp_int_combo_box_get_active),
 				&QWISaveData.subsampling);
 
+	/* autocrop checkbox */
+	pg.autocrop = check = gtk_check_button_new_with_mnemonic ("Cr_op transparent borders");
+	gtk_box_pack_start (GTK_BOX (vbox2), check, FALSE, FALSE, 0);
+	gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (check), QWISaveData.autocrop);
+	gtk_widget_show (check);
+	g_signal_connect (check, "toggled",
+			G_CALLBACK (gimp_toggle_button_update),
+			&QWISaveData.autocrop);
+
 	// default qualities buttons
 	vbox = gtk_box_new (GTK_ORIENTATION_VERTICAL, 12);
 	gtk_container_set_border_width (GTK_CONTAINER (vbox), 12);